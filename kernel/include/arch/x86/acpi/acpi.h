@@ -147,6 +147,82 @@ namespace acpi
         const std::uint32_t acpi_id;
     };
 
+    /// \brief System Resource Affinity Table
+    /// Assigns processors and ranges of memory to proximity domains, which is what NUMA nodes are built from
+    /// See: ACPI specification, section 5.2.16
+    struct [[gnu::packed]] srat
+    {
+        inline constexpr static const std::uint32_t SIGNATURE = 0x54415253; // "SRAT"
+        const acpi_sdt_header parent;
+        const std::uint32_t reserved0;
+        const std::uint64_t reserved1;
+    };
+
+    /// \brief The header of a single entry within the SRAT, laid out like the one of the MADT
+    using srat_entry_descriptor = madt_entry_descriptor;
+
+    /// \brief The entry within the SRAT that places a LAPIC in a proximity domain
+    ///
+    struct [[gnu::packed]] srat_processor_affinity
+    {
+        inline constexpr static const std::uint32_t SIGNATURE = 0;
+        inline constexpr static const std::uint32_t FLAG_ENABLED = 1 << 0;
+        const std::uint8_t proximity_domain_low;
+        const std::uint8_t apic_id;
+        const std::uint32_t flags;
+        const std::uint8_t local_sapic_eid;
+        const std::uint8_t proximity_domain_high[3];
+        const std::uint32_t clock_domain;
+    };
+
+    /// \brief The entry within the SRAT that places a range of physical memory in a proximity domain
+    ///
+    struct [[gnu::packed]] srat_memory_affinity
+    {
+        inline constexpr static const std::uint32_t SIGNATURE = 1;
+        inline constexpr static const std::uint32_t FLAG_ENABLED = 1 << 0;
+        const std::uint32_t proximity_domain;
+        const std::uint16_t reserved0;
+        const std::uint64_t base;
+        const std::uint64_t length;
+        const std::uint32_t reserved1;
+        const std::uint32_t flags;
+        const std::uint64_t reserved2;
+    };
+
+    /// \brief The entry within the SRAT that places an x2APIC in a proximity domain
+    ///
+    struct [[gnu::packed]] srat_processor_x2apic_affinity
+    {
+        inline constexpr static const std::uint32_t SIGNATURE = 2;
+        inline constexpr static const std::uint32_t FLAG_ENABLED = 1 << 0;
+        const std::uint16_t reserved0;
+        const std::uint32_t proximity_domain;
+        const std::uint32_t x2apic_id;
+        const std::uint32_t flags;
+        const std::uint32_t clock_domain;
+        const std::uint32_t reserved1;
+    };
+
+    /// \brief High Precision Event Timer Description Table
+    /// Describes where the registers of the HPET block are
+    /// See: IA-PC HPET Specification, section 3.2.4
+    struct [[gnu::packed]] hpet
+    {
+        inline constexpr static const std::uint32_t SIGNATURE = 0x54455048; // "HPET"
+        const acpi_sdt_header parent;
+        const std::uint32_t event_timer_block_id;
+        // a generic address structure, only system memory is valid here
+        const std::uint8_t address_space_id;
+        const std::uint8_t register_bit_width;
+        const std::uint8_t register_bit_offset;
+        const std::uint8_t reserved;
+        const std::uint64_t address;
+        const std::uint8_t hpet_number;
+        const std::uint16_t minimum_tick;
+        const std::uint8_t page_protection;
+    };
+
     /// \brief Checks an table's checksum value, and return true if the checksum was successful
     /// \return Wether or not the table is valid
     template <typename T>
@@ -64,6 +64,9 @@ namespace apic
     private:
         apic_registers* reg_start = nullptr;
         std::uint64_t ticks_per_ms{};
+        std::uint64_t tsc_per_ms{};
+        std::uint8_t timer_vector{};
+        bool tsc_deadline{};
 
     public:
         /// \brief Check for the presense of an LAPIC on the current core
@@ -81,8 +84,9 @@ namespace apic
         /// \brief Calibrates the Advanced Programmable Interrupt Timer
         /// \return The ticks per millisecond
         ///
-        /// This computes the APIT ticks per millisecond, and stores it into a cached value
-        /// A call to this function should occur before any call to set_tick()
+        /// This computes the APIT ticks per millisecond against the TSC, and stores it into a cached value, along with the TSC
+        /// ticks per millisecond. Needs timer::init_clock(). A call to this function should occur before any call to set_tick() or
+        /// init_timer()
         auto calibrate() -> std::uint64_t;
 
         /// \brief Sets the amount of ticks before a timer interrupt
@@ -92,6 +96,32 @@ namespace apic
         /// defined by \p irq, which requires that the core's IDT contain an entry for the specified vector
         void set_tick(std::uint8_t irq, std::size_t tick_ms);
 
+        /// \brief Sets the timer up to fire once per arm_timer() call, at the IRQ \p irq
+        ///
+        /// Uses TSC-deadline mode where the cpu has it, which is a single MSR write to rearm and cheap to virtualize, and the
+        /// one-shot count otherwise. The timer stays stopped until the first arm_timer(). Needs calibrate() first.
+        void init_timer(std::uint8_t irq);
+
+        /// \brief Raises the timer interrupt once, \p ns nanoseconds from now
+        ///
+        /// Replaces whatever was armed before. The one-shot count is clamped to what the counter holds.
+        void arm_timer(std::uint64_t ns);
+
+        /// \brief Cancels the armed timer interrupt, if it has not fired yet
+        void stop_timer();
+
+        /// \brief The vector init_timer() set up, or 0 before that
+        ///
+        /// Other cores send an IPI with it to make this core run its timer handler early.
+        [[nodiscard]] auto get_timer_vector() const -> std::uint8_t { return timer_vector; }
+
+        /// \brief Sends an inter-processor interrupt
+        /// \param apic_id The LAPIC id of the target core
+        /// \param vector The vector to raise on the target
+        ///
+        /// Returns once the LAPIC has accepted the IPI, not once the target has handled it
+        void send_ipi(std::uint32_t apic_id, std::uint8_t vector);
+
         /// \brief Sets the base address for the APIC
         /// \param addr The new base address
         void set_apic_base(std::uintptr_t addr);
@@ -45,6 +45,15 @@ namespace apic
         return build_lvt_cmci(is_masked, is_send_pending, mode, vector);
     }
 
+    // interrupt command register, low half
+    inline constexpr std::uint32_t ICR_SEND_PENDING = 1 << 12;
+
+    constexpr auto build_icr(lvt_delivery_mode mode, std::uint8_t vector) -> std::uint32_t
+    {
+        // physical destination, assert, edge triggered, no shorthand
+        return (1 << 14) | (static_cast<std::uint32_t>(mode) << 8) | vector;
+    }
+
     constexpr auto build_lint(bool is_masked, bool is_level, bool remote_irr, bool int_in_pin_polarity, bool is_send_pending, lvt_delivery_mode mode,
                               std::uint8_t vector) -> std::uint32_t
     {
@@ -85,6 +85,20 @@ WRITE_CR(4)
 inline void invlpg(void* addr) { asm volatile("invlpg (%0)" : : "b"(addr) : "memory"); }
 inline void invlpg(std::uintptr_t addr) { invlpg(as_vptr(addr)); }
 
+/// \brief Wrapper for the `invpcid` instruction
+/// \param type The invalidation type, 0 for a single address, 1 for a whole PCID, 2 and 3 for every PCID with and without globals
+/// \param pcid The PCID to invalidate in, for types 0 and 1
+/// \param addr The address to invalidate, for type 0
+inline void invpcid(std::uint64_t type, std::uint64_t pcid, std::uintptr_t addr)
+{
+    struct
+    {
+        std::uint64_t pcid;
+        std::uint64_t addr;
+    } desc{pcid, addr};
+    asm volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
 /// \brief Wrapper for the `cli` instruction
 ///
 inline void disable_interrupt() { asm volatile("cli"); }
@@ -93,6 +107,40 @@ inline void disable_interrupt() { asm volatile("cli"); }
 ///
 inline void enable_interrupt() { asm volatile("sti"); }
 
+/// \brief Wrapper for the `pause` instruction
+///
+/// Used as a hint in spin-wait loops
+inline void pause() { asm volatile("pause" : : : "memory"); }
+
+/// \brief Wrapper for the `rdtsc` instruction
+/// \return The current value of the time stamp counter
+inline auto rdtsc() -> std::uint64_t
+{
+    std::uint32_t low = 0;
+    std::uint32_t high = 0;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((std::uint64_t)high << 32) | low;
+}
+
+/// \brief `rdtsc` that is not executed ahead of the instructions before it
+/// \return The current value of the time stamp counter
+inline auto rdtsc_ordered() -> std::uint64_t
+{
+    std::uint32_t low = 0;
+    std::uint32_t high = 0;
+    asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) : : "memory");
+    return ((std::uint64_t)high << 32) | low;
+}
+
+/// \brief Reads the `rflags` register
+///
+inline auto read_rflags() -> std::uint64_t
+{
+    std::uint64_t flags;
+    asm volatile("pushfq\n\tpopq %0" : "=r"(flags));
+    return flags;
+}
+
 namespace msr
 {
     inline constexpr std::uint64_t IA32_APIC_BASE = 0x1b;
@@ -101,6 +149,7 @@ namespace msr
     inline constexpr std::uint64_t IA32_GS_BASE = 0xc0000101;
     inline constexpr std::uint64_t IA32_KERNEL_GS_BASE = 0xc0000102;
     inline constexpr std::uint64_t IA32_PAT = 0x277;
+    inline constexpr std::uint64_t IA32_TSC_DEADLINE = 0x6e0;
     inline constexpr std::uint64_t IA32_STAR = 0xc0000081;
     inline constexpr std::uint64_t IA32_LSTAR = 0xc0000082;
     inline constexpr std::uint64_t IA32_CSTAR = 0xc0000083;
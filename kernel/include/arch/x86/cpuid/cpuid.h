@@ -81,7 +81,7 @@ namespace cpuid_info
         "smep",
         "bmi2",
         "erms",
-        "invalid",
+        "invpcid",
         "rtm",
         "pqm",
         "what the fuck",
@@ -167,9 +167,52 @@ namespace cpuid_info
         "IA32_ARCH_CAPABILITIES",
         "IA32_CORE_CAPABILITIES",
         "ssbd",
+        "ts",
+        "fid",
+        "vid",
+        "ttp",
+        "tm",
+        nullptr,
+        "100mhzsteps",
+        "hwpstate",
+        "invariant_tsc",
+        "cpb",
+        "eff_freq_ro",
+        "proc_feedback",
+        "proc_power_reporting",
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
     };
     // cSpell:enable
 
+    // feature ids for test_feature(), these index FEATURE_STRINGS
+    // leaf 1 edx, leaf 1 ecx, then leaf 7 ebx, ecx and edx, then leaf 0x80000007 edx, 32 bits each
+    enum feature : std::size_t
+    {
+        FEATURE_PCID = 32 + 17,
+        FEATURE_TSC_DEADLINE = 32 + 24,
+        FEATURE_INVPCID = 64 + 10,
+        // the TSC ticks at a constant rate in every P-, C- and T-state
+        FEATURE_INVARIANT_TSC = 160 + 8,
+    };
+
     /// \brief Initializes the caches for cpu-global cpuid based information
     ///
     void initialize_cpuglobal();
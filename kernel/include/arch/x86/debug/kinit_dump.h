@@ -6,4 +6,6 @@ namespace debug
     void dump_memory_map();
     void dump_cpuid_info();
     void dump_acpi_info();
+    /// \brief Prints the memory statistics of every core, in the same format the meminfo fd reads them
+    void dump_meminfo();
 } // namespace debug
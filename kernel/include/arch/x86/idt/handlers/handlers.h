@@ -28,6 +28,7 @@ namespace handlers
         while (true) {}
     }
     void handle_timer(std::uint64_t, std::uint64_t);
+    void handle_yield(std::uint64_t, std::uint64_t);
 
     inline constexpr idt::interrupt_handler INTERRUPT_HANDLERS[] = {
         handle_div_by_zero, handle_debug, handle_noop,         handle_breakpoints, handle_overflow, handle_bounds,
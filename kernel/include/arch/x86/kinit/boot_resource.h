@@ -9,7 +9,6 @@
 // boot_warn_flags
 enum init_warn_flags : std::uint32_t
 {
-    WARN_MMAP_OVERFLOW = 1 << 0,
     WARN_PMM_OVERFLOW = 1 << 1
 };
 
@@ -24,14 +23,15 @@ public:
 
 class boot_resource
 {
-    inline static constexpr std::size_t MMAP_ENTRIES = 48;
     std::uint64_t phys_addr;
     std::uint64_t ksize;
     std::size_t mmap_length;
     std::size_t pmrs_length;
     std::size_t cores;
     std::size_t bsp_id_lapic;
-    limine_memmap_entry mmap_entries[MMAP_ENTRIES];
+    // the memory map is read from the bootloader's response until copy_memmap() gives it a home on the heap
+    limine_memmap_entry** mmap_source;
+    limine_memmap_entry* mmap_entries;
     acpi::rsdp_descriptor* root_table;
     bool smp_status;
     std::uint32_t flags;
@@ -52,7 +52,7 @@ public:
     {
         for (std::size_t i = 0; i < mmap_length; i++)
         {
-            callback(mmap_entries[i]);
+            callback(memmap_entry(i));
         }
     }
 
@@ -75,6 +75,14 @@ public:
 
     [[nodiscard]] constexpr auto modules() const -> const modules& { return mods; }
 
-    [[nodiscard]] constexpr auto memmap() const -> const auto& { return mmap_entries; }
-    [[nodiscard]] constexpr auto memmap_length() const -> const auto& { return mmap_length; }
+    [[nodiscard]] auto memmap_entry(std::size_t index) const -> const limine_memmap_entry&
+    {
+        return mmap_entries != nullptr ? mmap_entries[index] : *mmap_source[index];
+    }
+    [[nodiscard]] constexpr auto memmap_length() const -> std::size_t { return mmap_length; }
+
+    /// \brief Copies the memory map out of bootloader memory, however many entries it has
+    ///
+    /// Needs the kernel heap, so it runs right after mm::init().
+    void copy_memmap();
 };
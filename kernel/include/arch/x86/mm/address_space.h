@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mm/paging/paging_entries.h>
+#include <sync/spinlock.h>
+#include <vector>
+
+namespace mm
+{
+    // a range of user memory that is populated lazily, one page at a time, when it is first touched
+    struct vm_area
+    {
+        std::uintptr_t start;
+        std::uintptr_t end;
+        paging::page_prop prop;
+
+        // [data_start, data_start + data_size) is initialized from data, everything else in the area reads as zero
+        // pages that data covers whole are mapped from it directly while they are only read, if it is page aligned
+        std::uintptr_t data_start;
+        const void* data;
+        std::size_t data_size;
+    };
+
+    class address_space
+    {
+        paging::page_table_entry* table;
+        lock::spinlock lock;
+        // sorted by start address
+        std::vector<vm_area> areas;
+
+        auto populate(std::uintptr_t page, bool write) -> bool;
+        void map_external(std::uintptr_t page, std::uintptr_t physical_addr, paging::page_prop prop);
+        auto break_cow(std::uintptr_t page, std::uint64_t& replaced) -> bool;
+
+    public:
+        address_space();
+        ~address_space();
+        address_space(const address_space&) = delete;
+        address_space(address_space&&) = delete;
+        auto operator=(const address_space&) -> address_space& = delete;
+        auto operator=(address_space&&) -> address_space& = delete;
+
+        [[nodiscard]] auto get_table() const -> paging::page_table_entry* { return table; }
+
+        /// \brief Registers a lazily populated range
+        ///
+        /// Areas may share their boundary pages, in which case such a page is built from every area that covers it.
+        void add_area(const vm_area& area);
+
+        /// \brief Creates a copy of this address space that shares every populated page copy-on-write
+        ///
+        /// Only the page tables are duplicated, the pages themselves are copied on the first write from either side.
+        auto clone() -> address_space*;
+
+        /// \brief Resolves a fault at \p addr in this address space
+        /// \return Whether the fault was handled and the faulting access can be retried
+        auto handle_fault(std::uintptr_t addr, std::uint64_t error_code) -> bool;
+    };
+
+    /// \brief Entry point of the page fault handler into the memory manager
+    /// \return Whether the fault was resolved, if not it is a real fault
+    auto handle_page_fault(std::uintptr_t addr, std::uint64_t error_code) -> bool;
+} // namespace mm
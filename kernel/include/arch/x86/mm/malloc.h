@@ -4,9 +4,27 @@
 
 namespace alloc
 {
+    // a snapshot of how the heap is used, in bytes
+    struct heap_info
+    {
+        // everything mapped for the heap so far, block headers included
+        std::size_t size;
+        std::size_t used;
+        std::size_t free;
+        std::size_t free_blocks;
+        // a block out of the largest non-empty size class, roughly the biggest allocation possible without growing the heap
+        std::size_t largest_free;
+    };
+
     void init(void* ptr, std::size_t size);
     auto malloc(std::size_t size) -> void*;
     auto aligned_malloc(std::size_t size, std::size_t align) -> void*;
     auto realloc(void* buf, std::size_t size) -> void*;
     void free(void* buffer);
+
+    /// \brief Describes how fragmented the heap is
+    ///
+    /// Only reads counters and a list head, so it is safe to call without the heap lock, but the values may be slightly
+    /// inconsistent with each other if the heap changes at the same time.
+    auto get_heap_info() -> heap_info;
 } // namespace alloc
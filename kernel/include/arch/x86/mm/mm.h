@@ -1,6 +1,8 @@
 #pragma once
 
+#include <atomic>
 #include <bitmanip.h>
+#include <bits/mathhelper.h>
 #include <bitset>
 #include <config.h>
 #include <cstddef>
@@ -56,21 +58,45 @@ namespace mm
         return (T*)make_virtual_kern(phy);
     }
 
+    // the largest block the buddy allocator hands out, which is enough to back a single 1 GiB mapping
+    inline constexpr std::size_t PMM_MAX_ORDER = std::ceil_logbase2(paging::PAGE_LARGE_TO_SMALL_RATIO);
+    // the order of a block that backs a single 2 MiB mapping
+    inline constexpr std::size_t PMM_MEDIUM_ORDER = std::ceil_logbase2(paging::PAGE_MEDIUM_TO_SMALL_RATIO);
+
     // information about a physical page
+    // kept at 16 bytes, so four of them share a cache line; anything that needs locking is protected by whoever owns the page
     class page_info
     {
-        // linked list stuff
-        tag_ptr<page_info> prev;
-        tag_ptr<page_info> next;
-        lock::spinlock spinlock;
-        std::uint32_t padding0;
-        std::uint64_t padding1;
+        // linked list stuff, as page indices rather than pointers
+        std::uint32_t prev{NO_PAGE};
+        std::uint32_t next{NO_PAGE};
+        // number of page table entries mapping this page, only tracked for pages of user address spaces
+        std::uint32_t refcount{};
+        std::uint8_t type_bits : 3 {};
+        // buddy allocator state, only meaningful for the first page of a block
+        std::uint8_t order : 5 {};
+        std::uint8_t region{};
+        // spare, room for a map count once something needs one apart from refcount
+        std::uint16_t padding0{};
+
+        static auto from_index(std::uint32_t index) -> page_info*
+        {
+            return index == NO_PAGE ? nullptr : as_ptr<page_info>(config::get_val<"mmap.start.pfn">) + index;
+        }
+
+        static auto to_index(const page_info* info) -> std::uint32_t
+        {
+            return info == nullptr ? NO_PAGE : std::uint32_t(info - as_ptr<page_info>(config::get_val<"mmap.start.pfn">));
+        }
 
     public:
-        [[nodiscard]] constexpr auto get_prev() const { return prev.get_ptr(); }
-        [[nodiscard]] constexpr auto get_next() const { return next.get_ptr(); }
-        [[nodiscard]] constexpr auto set_prev(page_info* new_prev) { prev.set_ptr(new_prev); }
-        [[nodiscard]] constexpr auto set_next(page_info* new_next) { next.set_ptr(new_next); }
+        // a 32 bit index is enough for 16 TiB of physical memory
+        inline static constexpr std::uint32_t NO_PAGE = ~0U;
+
+        [[nodiscard]] auto get_prev() const -> page_info* { return from_index(prev); }
+        [[nodiscard]] auto get_next() const -> page_info* { return from_index(next); }
+        void set_prev(page_info* new_prev) { prev = to_index(new_prev); }
+        void set_next(page_info* new_next) { next = to_index(new_next); }
 
         enum type
         {
@@ -79,29 +105,73 @@ namespace mm
             USED_MM,
             USED_PFN,
             USED_DMA,
-            TYPE_MAX = USED_DMA
+            USED_SLAB,
+            TYPE_MAX = USED_SLAB
         };
 
         static_assert(TYPE_MAX < 8);
 
-        [[nodiscard]] constexpr auto get_type() const { return (type)prev.get_tag(); }
-        [[nodiscard]] constexpr auto set_type(type t) { return prev.set_tag(t); }
-        [[nodiscard]] constexpr auto get_lock() -> auto& { return spinlock; }
+        [[nodiscard]] constexpr auto get_type() const { return (type)type_bits; }
+        constexpr void set_type(type t) { type_bits = t; }
+
+        [[nodiscard]] constexpr auto get_order() const -> std::size_t { return order; }
+        constexpr void set_order(std::size_t new_order) { order = new_order; }
+        [[nodiscard]] constexpr auto get_region() const -> std::size_t { return region; }
+        constexpr void set_region(std::size_t new_region) { region = new_region; }
+
+        [[nodiscard]] auto get_refcount() const -> std::size_t { return std::direct_atomic_load_n(&refcount, std::memory_order_acquire); }
+        void set_refcount(std::uint32_t count) { std::direct_atomic_store_n(&refcount, count, std::memory_order_release); }
+        void acquire() { std::direct_atomic_fetch_add(&refcount, 1U, std::memory_order_relaxed); }
+        /// \return The number of references left
+        auto release() -> std::size_t { return std::direct_atomic_fetch_sub(&refcount, 1U, std::memory_order_acq_rel) - 1; }
     };
 
     // make sure that the size of the page_info is 2^n
     static_assert(__builtin_popcount(sizeof(page_info)) == 1);
+    static_assert(sizeof(page_info) == 16);
+    static_assert(PMM_MAX_ORDER < 32, "page_info::order is 5 bits wide");
+
+    // the PFN array is split into sections whose page_info entries fill exactly one 2 MiB page
+    // only sections that contain usable memory have their part of the array mapped, holes in the memory map cost nothing
+    inline constexpr std::size_t PFN_SECTION_PAGES = paging::PAGE_MEDIUM_SIZE / sizeof(page_info);
+
+    /// \brief Whether the page_info of the page with index \p index can be accessed
+    auto pfn_valid(std::size_t index) -> bool;
+    // a per-core stack of free single pages that sits in front of the buddy allocator
+    // it is refilled up to the low watermark when empty, and drained back down to it once it reaches the high watermark
+    struct page_cache
+    {
+        std::size_t count{};
+        void* pages[config::get_val<"pmm.cache.high">]{};
+    };
+
     // pmm routines
+    /// \brief Hands a range of usable memory to the pmm
+    ///
+    /// Only the first pmm.early-pages pages (rounded up to a 2 MiB boundary) handed over are set up right away, the PFN entries of
+    /// everything past that are left for pmm_init_deferred().
     void pmm_add_region(std::uintptr_t, std::size_t);
-    auto pmm_allocate() -> void*;
-    INLINE auto pmm_allocate_clean() -> void*
+    /// \brief Sets up the memory pmm_add_region() deferred, one chunk at a time, until none is left
+    ///
+    /// Every core runs this from a batch priority kernel thread once it is up, so the work is spread over all of them and
+    /// happens with interrupts on.
+    void pmm_init_deferred();
+
+    /// \brief Allocates 2^order physically contiguous pages, aligned to their size
+    ///
+    /// Memory comes from the NUMA node of the calling core while it has any, and from the other nodes after that.
+    /// \return The HHDM address of the first page, or null if no block of that order is available
+    auto pmm_allocate(std::size_t order = 0) -> void*;
+    INLINE auto pmm_allocate_clean(std::size_t order = 0) -> void*
     {
-        auto* ptr = pmm_allocate();
-        return ptr != nullptr ? std::memset(ptr, 0, paging::PAGE_SMALL_SIZE) : ptr;
+        auto* ptr = pmm_allocate(order);
+        return ptr != nullptr ? std::memset(ptr, 0, paging::PAGE_SMALL_SIZE << order) : ptr;
     }
 
-    auto pmm_free(void* addr);
-    auto pmm_get_free_list() -> std::intrusive_list<page_info>&;
+    /// \brief Returns a block obtained from pmm_allocate(), merging it with any free buddies
+    void pmm_free(void* addr, std::size_t order = 0);
+    /// \brief Physical address of a page that is never written to, mapped read-only wherever untouched memory should read as zero
+    auto zero_page() -> std::uintptr_t;
     auto pmm_stupid_allocate() -> void*;
 
     INLINE auto page_to_pfn(void* addr) -> page_info&
@@ -119,8 +189,49 @@ namespace mm
         return make_virtual(((as_uptr(&info) - config::get_val<"mmap.start.pfn">) / sizeof(page_info)) * paging::PAGE_SMALL_SIZE);
     }
 
+    INLINE auto pfn_to_index(const page_info& info) -> std::size_t
+    {
+        return (as_uptr(&info) - config::get_val<"mmap.start.pfn">) / sizeof(page_info);
+    }
+
+    INLINE auto index_to_pfn(std::size_t index) -> page_info& { return as_ptr<page_info>(config::get_val<"mmap.start.pfn">)[index]; }
+
+    inline constexpr std::size_t STACK_PAGES = 256;
+    // pages at the top of a demand paged stack that are mapped up front
+    inline constexpr std::size_t STACK_PREFAULT_PAGES = 4;
+    // zeroed pages every core keeps for the faults of demand paged stacks
+    inline constexpr std::size_t FAULT_RESERVE_PAGES = 8;
+
+    // the page fault handler takes from this when the faulting code was in the middle of the pmm
+    struct fault_reserve
+    {
+        std::size_t count{};
+        void* pages[FAULT_RESERVE_PAGES]{};
+    };
+
     auto vmm_allocate(std::size_t pages) -> void*;
+    /// \brief Returns a range obtained from vmm_allocate() or vmm_allocate_mapped()
+    ///
+    /// Any pages still mapped in the range are unmapped and handed back to the pmm.
     void vmm_free(void* pointer, std::size_t pages);
+    /// \brief Backs [vaddr, vaddr + pages * 4 KiB) in the kernel tables with newly allocated memory
+    ///
+    /// Every 2 MiB aligned stretch is mapped with a single large page when the pmm can provide one, the rest with small pages.
+    void map_fresh_pages(std::uintptr_t vaddr, std::size_t pages, bool clean);
+    /// \brief vmm_allocate() followed by map_fresh_pages(), allocations of 2 MiB or more are aligned to make use of large pages
     auto vmm_allocate_mapped(std::size_t pages) -> void*;
-    auto allocate_stack() -> void*;
+    /// \brief Allocates a kernel stack of STACK_PAGES pages
+    ///
+    /// With \p demand_paged only the top STACK_PREFAULT_PAGES pages are backed, the rest is populated by the page fault
+    /// handler when touched. Stacks that the #PF handler itself may run on (the IST stacks)
+    /// must not be demand paged.
+    /// \return The top of the stack
+    auto allocate_stack(bool demand_paged = false) -> void*;
+    void free_stack(void* top);
+    /// \brief Tops the current core's fault reserve back up from the pmm
+    ///
+    /// Must not run while the core is inside the pmm. Called while the core is brought up, from every timer interrupt and
+    /// yield after that, which never land inside the pmm since it keeps interrupts off, and from page faults that did not
+    /// interrupt the pmm.
+    void refill_fault_reserve();
 } // namespace mm
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mm
+{
+    // proximity domains past this many all end up on node 0
+    inline constexpr std::size_t MAX_NUMA_NODES = 8;
+
+    /// \brief Reads the processor and memory affinities out of the SRAT
+    ///
+    /// Without an SRAT, or on a machine with a single proximity domain, everything belongs to node 0. Runs at the very start of
+    /// mm::init(), while the bootloader's HHDM still covers the ACPI tables.
+    void numa_init();
+
+    auto numa_node_count() -> std::size_t;
+
+    /// \brief Finds the node of the physical address \p addr
+    /// \param[out] end Receives the end of the range around \p addr that belongs to the same node
+    auto numa_node_of(std::uintptr_t addr, std::uintptr_t* end = nullptr) -> std::size_t;
+
+    /// \brief Finds the node of the core with the LAPIC id \p apic_id
+    auto numa_node_of_apic(std::uint32_t apic_id) -> std::size_t;
+} // namespace mm
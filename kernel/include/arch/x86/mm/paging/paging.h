@@ -2,10 +2,12 @@
 #pragma once
 
 #include "paging_entries.h"
+#include <atomic>
 #include <bitmanip.h>
 #include <cstdint>
 #include <misc/pointer.h>
 #include <mm/mm.h>
+#include <mm/paging/tlb.h>
 
 namespace paging
 {
@@ -16,15 +18,122 @@ namespace paging
         BIG        // 1 GiB
     };
 
+    /// \brief The page tables of the kernel, shared by every core and every kernel thread
+    ///
+    /// The upper half PML4 entries are all allocated by smp::init(), so the copies user address spaces take of them never go
+    /// stale.
+    auto kernel_table() -> page_table_entry*;
+    /// \brief Creates the empty kernel page tables with the early allocator, must run before anything is mapped into them
+    void init_kernel_table();
     void install();
 
+    /// \brief Maps \p physical_addr at \p virtual_addr in \p table
+    ///
+    /// Takes no lock, so cores can map into disjoint parts of the same table concurrently: missing tables are installed with a
+    /// CAS and, unless \p overwrite is set, so is the final entry. Returns false if the entry was already in use.
+    /// \p extra_flags are software bits such as EXTERNAL that go into the entry together with everything else.
     auto map_page_for(page_table_entry* table, page_type type, std::uintptr_t virtual_addr, std::uintptr_t physical_addr, page_prop prop,
-                      bool overwrite) -> bool;
+                      bool overwrite, std::uint64_t extra_flags = 0) -> bool;
     auto map_page_for_early(page_table_entry* table, page_type type, std::uintptr_t virtual_addr, std::uintptr_t physical_addr, page_prop prop,
                             bool overwrite) -> bool;
     auto request_page(page_type type, std::uint64_t vaddr, std::uint64_t paddr, page_prop prop = {}, bool overwrite = false) -> bool;
     auto request_page_early(page_type type, std::uint64_t vaddr, std::uint64_t paddr, page_prop prop = {}, bool overwrite = false) -> bool;
 
+    /// \brief Marks the 4 KiB page at \p virtual_addr as demand-zero in \p table
+    ///
+    /// The page stays non-present until it is first touched, at which point the page fault handler backs it with a zeroed page.
+    auto reserve_page_for(page_table_entry* table, std::uintptr_t virtual_addr, page_prop prop) -> bool;
+    auto reserve_page(std::uintptr_t vaddr, page_prop prop = {}) -> bool;
+
+    /// \brief Finds the last level entry for \p virtual_addr without creating any tables
+    /// \return The entry, or null if one of the tables on the way is missing or \p virtual_addr is part of a larger page
+    auto lookup_entry(page_table_entry* table, std::uintptr_t virtual_addr) -> page_table_entry*;
+    /// \return The physical address \p virtual_addr maps to in \p table, or 0 if it is not mapped
+    auto translate(const page_table_entry* table, std::uintptr_t virtual_addr) -> std::uintptr_t;
+
+    /// \brief Removes the mapping of \p virtual_addr from \p table
+    /// \param[out] type If not null, receives the size of the mapping, 2 MiB mappings must be removed from their first page
+    /// \return The physical address that was mapped there, or 0 if the page was not mapped
+    ///
+    /// The TLB is left untouched, callers are expected to batch invalidations with flush_tlb_range().
+    auto unmap_page_for(page_table_entry* table, std::uintptr_t virtual_addr, page_type* type = nullptr) -> std::uintptr_t;
+    auto unmap_page(std::uintptr_t vaddr, page_type* type = nullptr) -> std::uintptr_t;
+
+    // past this many pages, reloading cr3 is cheaper than invalidating each page
+    inline constexpr std::size_t INVLPG_MAX_PAGES = 32;
+
+    /// \brief Invalidates \p pages pages starting at \p vaddr on every core
+    ///
+    /// Use a tlb_batch directly to invalidate several ranges with a single round of IPIs.
+    void flush_tlb_range(std::uintptr_t vaddr, std::size_t pages);
+    INLINE void flush_tlb_range(const tlb_range& range) { flush_tlb_range(range.start, range.pages); }
+    /// \brief Invalidates \p range on the current core only, enough after mapping pages that were not present before
+    void invalidate_local(const tlb_range& range);
+
+    /// \brief Returns the last level table covering \p virtual_addr in \p table, creating any missing tables on the way
+    /// \param early Whether missing tables come from the early allocator rather than the pmm
+    auto leaf_table_for(page_table_entry* table, std::uintptr_t virtual_addr, bool early = false) -> page_table_entry*;
+    /// \brief Like leaf_table_for(), but returns null instead of creating tables or descending into larger pages
+    auto find_leaf_table(page_table_entry* table, std::uintptr_t virtual_addr) -> page_table_entry*;
+
+    /// \brief Writes a last level entry the way map_page_for() does, panics if it is in use and \p overwrite is not set
+    void install_leaf(page_table_entry& entry, std::uint64_t value, bool overwrite);
+
+    /// \brief Maps \p pages 4 KiB pages starting at \p vaddr in \p table, page i goes to the physical address provider(i)
+    ///
+    /// The tree is walked once per last level table rather than once per page, and entries are installed the same way
+    /// map_page_for() does. Without \p overwrite, finding a page already mapped is fatal.
+    /// \return The range that was mapped, for the caller to invalidate however it needs to
+    template <typename Provider>
+    auto map_range(page_table_entry* table, std::uintptr_t vaddr, Provider&& provider, std::size_t pages, page_prop prop,
+                   bool overwrite = false, bool early = false) -> tlb_range
+    {
+        std::size_t i = 0;
+        while (i < pages)
+        {
+            page_table_entry* leaf = leaf_table_for(table, vaddr + i * PAGE_SMALL_SIZE, early);
+            for (std::size_t index = get_page_entry(vaddr + i * PAGE_SMALL_SIZE, 3); index < 512 && i < pages; index++, i++)
+            {
+                install_leaf(leaf[index], make_page_small(provider(i), prop), overwrite);
+            }
+        }
+
+        return {vaddr, pages};
+    }
+
+    /// \brief Removes the 4 KiB mappings of \p pages pages starting at \p vaddr from \p table
+    ///
+    /// consumer(i, physical_addr) is called for every page i that was mapped, with the physical address it was mapped to. The range
+    /// must not contain large pages, those need unmap_page_for().
+    /// \return The range that was unmapped, which must be flushed on every core before the virtual range is reused
+    template <typename Consumer>
+    auto unmap_range(page_table_entry* table, std::uintptr_t vaddr, std::size_t pages, Consumer&& consumer) -> tlb_range
+    {
+        std::size_t i = 0;
+        while (i < pages)
+        {
+            std::size_t index = get_page_entry(vaddr + i * PAGE_SMALL_SIZE, 3);
+            page_table_entry* leaf = find_leaf_table(table, vaddr + i * PAGE_SMALL_SIZE);
+            if (leaf == nullptr)
+            {
+                // nothing mapped in the rest of this table
+                i += 512 - index;
+                continue;
+            }
+
+            for (; index < 512 && i < pages; index++, i++)
+            {
+                auto value = std::direct_atomic_exchange_n(&leaf[index], std::uint64_t{0}, std::memory_order_acq_rel);
+                if (value & PRESENT)
+                {
+                    consumer(i, value & MASK_TABLE_SMALL);
+                }
+            }
+        }
+
+        return {vaddr, pages};
+    }
+
     template <std::uint8_t t>
     constexpr auto get_page_entry(std::uint64_t virtual_addr) -> std::uint16_t
     {
@@ -48,6 +157,5 @@ namespace paging
 
     void map_hhdm_section(std::uint64_t addr, std::uint64_t len, paging::page_prop prop, bool overwrite = false);
     void map_hhdm_section_early(std::uint64_t addr, std::uint64_t len, paging::page_prop prop, bool overwrite = false);
-    void sync_page_tables(std::size_t dest_core, std::size_t src_core);
     void copy_kernel_page_tables(page_table_entry* dest, const page_table_entry* src);
 } // namespace paging
@@ -11,6 +11,13 @@ namespace paging
     constexpr std::uint64_t USR_SUP = 0x4;
     constexpr std::uint64_t ACCESSED = 0x20;
     constexpr std::uint64_t PAGE_SIZE = 0x80;
+    // software bit, only used in non-present entries: the page gets a zeroed frame on first access
+    constexpr std::uint64_t DEMAND_ZERO = 0x200;
+    // software bit, only used in present read-only entries: the page is shared and gets copied on the first write
+    constexpr std::uint64_t COPY_ON_WRITE = 0x400;
+    // software bit, only used in present entries: the frame is not owned by the address space and is not reference counted
+    constexpr std::uint64_t EXTERNAL = 0x800;
+    constexpr std::uint64_t NO_EXECUTE = 1UL << 63;
 
     constexpr std::uint64_t MASK_TABLE_POINTER = 0xFFFFFFFFFF000;
     constexpr std::uint64_t MASK_TABLE_LARGE = 0xFFFFFC0000000;
@@ -95,6 +102,20 @@ namespace paging
             (target & MASK_TABLE_LARGE);
     }
 
+    // a non-present entry that remembers the permissions the page should get once it is populated
+    constexpr auto make_page_demand(page_prop flags) -> std::uint64_t
+    {
+        return DEMAND_ZERO |
+            ((std::uint8_t) flags.rw << 1) |
+            ((std::uint8_t) flags.us << 2) |
+            ((std::uint64_t) !flags.x << 63);
+    }
+
+    constexpr auto get_page_prop(std::uint64_t entry) -> page_prop
+    {
+        return {.rw = (entry & RD_WR) != 0, .us = (entry & USR_SUP) != 0, .x = (entry & NO_EXECUTE) == 0};
+    }
+
     using page_table_entry = std::uint64_t;
 
     inline constexpr std::size_t PAGE_SMALL_SIZE = 0x1000;
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sync/spinlock.h>
+
+namespace paging
+{
+    // fixed on every core, so that any core can target any other one
+    inline constexpr std::uint8_t TLB_SHOOTDOWN_VECTOR = 0xf0;
+    inline constexpr std::size_t TLB_QUEUE_SIZE = 16;
+
+    inline constexpr std::uint64_t CR4_PCIDE = 1 << 17;
+    inline constexpr std::uint64_t CR3_NO_FLUSH = 1UL << 63;
+    inline constexpr std::uint64_t MASK_CR3_PCID = 0xfff;
+    // how many address spaces each core keeps tagged in its TLB
+    inline constexpr std::size_t PCID_SLOTS = 8;
+
+    // the page tables this core has tagged with a PCID, slot i uses PCID i + 1
+    struct pcid_cache
+    {
+        bool enabled{};
+        std::size_t next{};
+        std::uintptr_t tables[PCID_SLOTS]{};
+        // slots that may still hold translations which were invalidated while another PCID was active
+        std::uint32_t stale{};
+    };
+
+    struct tlb_range
+    {
+        std::uintptr_t start;
+        std::size_t pages;
+    };
+
+    // invalidations other cores have asked this core to perform
+    // once the ranges don't fit anymore, the whole TLB is flushed instead
+    struct tlb_queue
+    {
+        lock::spinlock lock;
+        bool online{};
+        bool flush_all{};
+        std::size_t count{};
+        tlb_range ranges[TLB_QUEUE_SIZE]{};
+
+        // tickets handed out to requesters, and the last one this core has completed
+        std::uint64_t requested{};
+        std::uint64_t completed{};
+    };
+
+    /// \brief Collects invalidations and performs them on every core at once
+    ///
+    /// The local TLB is flushed right away on flush(), every other online core gets its share of the batch queued and at
+    /// most one IPI. flush() only returns once every core has dropped the stale translations, so pages that were unmapped
+    /// can be reused afterwards.
+    class tlb_batch
+    {
+        tlb_range ranges[TLB_QUEUE_SIZE]{};
+        std::size_t count{};
+        bool flush_all{};
+
+    public:
+        tlb_batch() = default;
+        tlb_batch(const tlb_batch&) = delete;
+        tlb_batch(tlb_batch&&) = delete;
+        auto operator=(const tlb_batch&) -> tlb_batch& = delete;
+        auto operator=(tlb_batch&&) -> tlb_batch& = delete;
+        ~tlb_batch() { flush(); }
+
+        void add(std::uintptr_t vaddr, std::size_t pages);
+        void flush();
+    };
+
+    /// \brief Registers the shootdown handler on the current core and starts accepting requests
+    void init_tlb_shootdown();
+
+    /// \brief Turns on PCIDs for the current core if the cpu supports them
+    ///
+    /// Must run while cr3 still has PCID 0 loaded.
+    void init_pcid();
+
+    /// \brief Loads the page tables at \p physical_addr
+    ///
+    /// Does nothing if they are already loaded. With PCIDs, the translations of the last PCID_SLOTS page tables used on this
+    /// core are kept around instead of being flushed on every switch.
+    void switch_table(std::uintptr_t physical_addr);
+
+    /// \brief Drops the PCID of the page tables at \p physical_addr on every core, before they are freed
+    void release_pcid(std::uintptr_t physical_addr);
+} // namespace paging
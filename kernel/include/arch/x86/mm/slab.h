@@ -1,13 +1,35 @@
 #pragma once
 
+#include <config.h>
 #include <cstddef>
+#include <sync/spinlock.h>
 
 namespace mm
 {
-    void init_slab();
+    struct slab_header;
 
+    inline constexpr std::size_t SLAB_CLASS_COUNT = config::get_val<"slab.max_order"> - config::get_val<"slab.min_order"> + 1;
+
+    // the slabs a single core owns for one object size
+    // objects freed from another core are returned to the slab they came from, which is why this still has a lock
+    struct slab_cache
+    {
+        lock::spinlock lock;
+        // slabs with at least one free object
+        slab_header* partial{};
+        // a single fully free slab is kept around, so that an alloc/free pair at a boundary does not hit the pmm every time
+        slab_header* empty{};
+    };
+
+    /// \brief Allocates an object of \p size bytes
+    /// \return A pointer aligned to the object's size class, or null if out of memory
+    ///
+    /// Sizes up to 2^slab.max_order are served from the current core's object caches, anything larger is handed out
+    /// directly by the page allocator.
     auto slab_allocate(std::size_t size) -> void*;
     void slab_free(void* ptr);
+    /// \brief The usable size of an allocation obtained from slab_allocate()
+    auto slab_size(void* ptr) -> std::size_t;
 
     template <typename T>
     auto slab_allocate() -> T*
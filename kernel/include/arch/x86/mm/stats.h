@@ -0,0 +1,55 @@
+#pragma once
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace mm
+{
+    // how a page fault was resolved, or that it could not be
+    enum fault_kind : std::size_t
+    {
+        // a kernel page reserved with paging::reserve_page was touched for the first time
+        FAULT_KERNEL_DEMAND_ZERO,
+        // a lazily populated user page was touched for the first time
+        FAULT_USER_POPULATE,
+        // a write to a copy-on-write page that had to be copied
+        FAULT_COW_COPY,
+        // a write to a copy-on-write page nobody else referenced anymore, so it was made writable in place
+        FAULT_COW_REUSE,
+        // nothing could handle it, the fault ends in a panic
+        FAULT_UNHANDLED,
+        FAULT_KIND_COUNT,
+    };
+
+    // counters a single core keeps about the memory work it did
+    // only the owning core writes them, so they need no lock; other cores only ever read them for a snapshot
+    struct mem_stats
+    {
+        // in pages, a block of order n counts as 2^n pages
+        std::uint64_t pmm_allocs{};
+        std::uint64_t pmm_frees{};
+        // how often the per-core page cache had to go to the buddy allocator
+        std::uint64_t pmm_refills{};
+        std::uint64_t pmm_drains{};
+        // an allocation served from a partially used slab is a hit, one that needed an empty or a new slab is a miss
+        std::uint64_t slab_hits{};
+        std::uint64_t slab_misses{};
+        std::uint64_t faults[FAULT_KIND_COUNT]{};
+        // the tables set up while booting, before there is any core_local, are not counted
+        std::uint64_t page_tables_allocated{};
+        std::uint64_t page_tables_freed{};
+    };
+
+    /// \brief Adds \p n to a counter of the current core's mem_stats
+    ///
+    /// A single add to memory cannot be torn by an interrupt, so this is safe without turning interrupts off.
+    INLINE void stat_add(std::uint64_t& counter, std::uint64_t n = 1) { asm volatile("addq %1, %0" : "+m"(counter) : "er"(n)); }
+
+    /// \brief Sums up the counters of every core
+    auto collect_mem_stats() -> mem_stats;
+
+    /// \brief Writes a /proc/meminfo style report of the memory statistics into \p buffer
+    /// \return The length of the report, which is truncated to fit and always NUL terminated
+    auto format_meminfo(char* buffer, std::size_t size) -> std::size_t;
+} // namespace mm
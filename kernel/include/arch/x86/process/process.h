@@ -4,6 +4,7 @@
 #include <asm/asm_cpp.h>
 #include <cstddef>
 #include <cstdint>
+#include <mm/address_space.h>
 #include <mm/mm.h>
 #include <mm/paging/paging.h>
 #include <slot_vector.h>
@@ -36,15 +37,41 @@ namespace proc
 
     constexpr auto operator!=(const task_id& lhs, const task_id& rhs) -> bool { return !(lhs == rhs); }
 
+    // 0 is the most urgent priority, PRIORITY_LEVELS - 1 the least
+    inline constexpr std::size_t PRIORITY_LEVELS = 32;
+    // latency sensitive kernel work, preempts everything below it on the next tick
+    inline constexpr std::uint8_t PRIORITY_HIGH = 8;
+    inline constexpr std::uint8_t PRIORITY_NORMAL = 16;
+    // throughput work that does not mind waiting, gets longer but rarer timeslices
+    inline constexpr std::uint8_t PRIORITY_BATCH = 24;
+
+    // bit n of an affinity mask allows a thread on core n, cores past 63 only take threads that may run anywhere
+    inline constexpr std::uint64_t AFFINITY_ANY = ~0UL;
+
     struct thread
     {
         context ctx{};
         // scheduler information
-        // std::size_t sched_index;
-        // std::size_t latest_scheduled_tick;
+        // threads are linked into the runqueue of their priority level through these, so the queues never fill up
+        thread* sched_prev{};
+        thread* sched_next{};
+        bool sched_queued{};
+        std::uint8_t priority = PRIORITY_NORMAL;
+        // timer ticks left until the thread is rotated to the back of its level
+        std::uint32_t timeslice{};
+        // the cores the load balancer may move the thread to
+        std::uint64_t affinity = AFFINITY_ANY;
+        // the core whose runqueue the thread belongs to, and whether that core is running it right now
+        std::size_t sched_core{};
+        bool on_cpu{};
         task_id id;
         thread_state state{};
         constexpr thread(task_id task_id) : id(task_id) {}
+
+        [[nodiscard]] constexpr auto runs_on(std::size_t core) const -> bool
+        {
+            return core < 64 ? ((affinity >> core) & 1) != 0 : affinity == AFFINITY_ANY;
+        }
     };
 
     class process
@@ -59,10 +86,19 @@ namespace proc
         std::slot_vector<user::file_desc> file_desc;
 
         std::uint32_t pid = 0;
+        // null for the kernel process, whose threads only run on the kernel half
+        mm::address_space* address_space = nullptr;
 
     public:
-        auto make_thread(const context& inital_context, std::size_t core) -> std::uint32_t;
+        /// \brief Creates a thread and queues it on \p core
+        ///
+        /// The thread only starts out on \p core, the load balancer may move it to any other core \p affinity allows. A thread
+        /// created in any \p state but RUNNING is not queued, it starts once scheduler::wake() is called on it.
+        auto make_thread(const context& inital_context, std::size_t core, std::uint8_t priority = PRIORITY_NORMAL,
+                         std::uint64_t affinity = AFFINITY_ANY, thread_state state = thread_state::RUNNING) -> std::uint32_t;
         auto get_thread(std::uint32_t tid) -> thread* { return &threads[tid]; }
+        auto get_address_space() -> mm::address_space* { return address_space; }
+        void set_address_space(mm::address_space* space) { address_space = space; }
     };
 
     auto get_process(std::uint32_t pid) -> process&;
@@ -73,7 +109,8 @@ namespace proc
     using kthread_fn_t = void (*)(std::uint64_t);
     using kthread_fn_args_t = void (*)(std::uint64_t);
 
-    auto make_kthread_args(kthread_fn_args_t thread_fn, std::uint64_t extra, std::size_t core) -> std::uint32_t;
+    auto make_kthread_args(kthread_fn_args_t thread_fn, std::uint64_t extra, std::size_t core, std::uint8_t priority = PRIORITY_NORMAL,
+                           std::uint64_t affinity = AFFINITY_ANY) -> std::uint32_t;
     auto make_kthread_args(kthread_fn_args_t thread_fn, std::uint64_t extra) -> std::uint32_t;
     inline auto make_kthread(kthread_fn_t thread_fn) -> std::uint32_t { return make_kthread_args(thread_fn, 0); }
     inline auto make_kthread(kthread_fn_t thread_fn, std::size_t core) -> std::uint32_t { return make_kthread_args(thread_fn, 0, core); }
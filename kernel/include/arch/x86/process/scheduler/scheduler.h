@@ -1,22 +1,122 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <cyclic_queue>
 #include <process/process.h>
 #include <sync/spinlock.h>
+#include <timer/timer.h>
 #include <utility>
 
 namespace scheduler
 {
+    static_assert(proc::PRIORITY_LEVELS <= 32, "the ready levels have to fit into one bitmap word");
+
+    // the length of one timeslice tick, while there is anything to run the timer fires this often
+    inline constexpr std::uint64_t TICK_NS = 20 * timer::NS_PER_MS;
+    // a thread raises this on itself to give the cpu away right now, fixed like the TLB shootdown vector
+    inline constexpr std::uint8_t YIELD_VECTOR = 0xf1;
+
+    /// \brief How many timer ticks a thread of \p priority runs before it has to give way to its peers
+    ///
+    /// Urgent levels get short slices so that they stay responsive among each other, batch levels long ones so that they
+    /// switch less often.
+    constexpr auto timeslice_of(std::uint8_t priority) -> std::uint32_t { return 1 + priority / 8; }
+
+    // the threads of one priority level that are ready to run, in the order they get the cpu
+    class run_list
+    {
+        proc::thread* head{};
+        proc::thread* tail{};
+
+    public:
+        void push_back(proc::thread* thread);
+        void push_front(proc::thread* thread);
+        void remove(proc::thread* thread);
+        [[nodiscard]] auto front() const -> proc::thread* { return head; }
+        [[nodiscard]] auto back() const -> proc::thread* { return tail; }
+        [[nodiscard]] auto empty() const -> bool { return head == nullptr; }
+    };
+
+    /// \brief The runqueue of a single core
+    ///
+    /// Every priority level has its own FIFO of ready threads, and a bitmap of the levels that have any, so picking the next
+    /// thread is a single bit scan no matter how many threads are ready. Other cores add threads to it, which is why it has a
+    /// lock.
+    ///
+    /// Idle cores steal work from the busiest core whenever they wake up, and busy ones even out with it every
+    /// sched.balance-interval ticks, so threads only start out on the core they were created for.
+    ///
+    /// The timer is one-shot and only rearmed while the core has something to run. An idle core stops it completely and
+    /// sleeps until another core kicks it with an IPI, either because it queued a thread here or because it has work to spare,
+    /// or until the next timer on its wheel is due.
     class scheduler
     {
-        stdext::circular_queue<proc::thread*, 32> tasks;
+        lock::spinlock lock;
+        run_list levels[proc::PRIORITY_LEVELS];
+        std::uint32_t ready_levels{};
+        // the load metric other cores compare against, read without the lock
+        std::size_t ready_count{};
+        std::size_t balance_ticks{};
         proc::thread* idle;
+        // the core this runqueue belongs to
+        std::size_t owner{};
+        // set while the core sleeps in idle without a timer, whoever clears it is responsible for waking it up
+        bool tick_stopped{};
+        // when the running thread's next timeslice tick is due, NEVER while the core idles
+        // interrupts before that, from kicks or timers, do not count against the timeslice
+        std::uint64_t next_tick = timer::NEVER;
+        // what the core is running right now, PRIORITY_LEVELS for the idle thread
+        std::uint8_t running_priority = proc::PRIORITY_LEVELS;
+
+        void enqueue(proc::thread* thread, bool front);
+        void dequeue(proc::thread* thread);
+        auto pop_highest() -> proc::thread*;
+        // whether a thread more urgent than priority is waiting
+        [[nodiscard]] auto has_above(std::uint8_t priority) const -> bool { return (ready_levels & ((1U << priority) - 1)) != 0; }
+        // takes a queued thread that may run on core off this runqueue, the most urgent one first
+        auto steal_for(std::size_t core) -> proc::thread*;
+        // moves a thread from the busiest other core to this one, if that evens out the load
+        void balance(std::size_t core, bool starving);
+        // picks the thread to run next, returns whether the core has anything but idle to run
+        auto switch_thread(proc::thread*& current, bool tick) -> bool;
+        // makes the owning core run its timer handler as soon as possible
+        void kick();
+        // kicks the owning core if it sleeps, or if a thread of priority should preempt what it runs
+        void notify(std::uint8_t priority);
 
     public:
         void add_task(proc::thread* thread);
         void set_state(proc::task_id tid, proc::thread_state state);
+
+        /// \brief Marks the current thread as waiting, the first step of blocking it
+        ///
+        /// Has to run on the current core with interrupts off. Whoever is meant to wake the thread must be able to find it
+        /// before wait() is called, a wake() in between makes wait() return right away.
+        void prepare_wait();
+
+        /// \brief Gives the cpu away until the current thread is woken up
+        ///
+        /// Needs interrupts on, and prepare_wait() first. The thread switches away right here through YIELD_VECTOR, without
+        /// waiting for a timer interrupt.
+        static void wait();
+
+        /// \brief Makes a waiting \p thread ready again, from any core and from interrupt handlers
+        ///
+        /// Does nothing if it is not waiting.
+        static void wake(proc::thread* thread);
+        /// \brief Picks the thread to run after this timer interrupt, and arms the next one
+        ///
+        /// The current thread keeps running until its timeslice is used up, unless something of a more urgent level became
+        /// ready in the meantime; a thread preempted that way goes back to the front of its level with what is left of its slice.
+        /// The next interrupt is armed for the next tick or the next timer on the core's wheel, whichever comes first.
         void load_sched_task_ctx();
+        /// \brief Sets the thread to run when nothing else is ready
+        ///
+        /// Has to run on the core the scheduler belongs to.
         void set_idle(proc::thread* thread);
+
+        /// \brief How many threads are waiting for this core
+        [[nodiscard]] auto load() const -> std::size_t { return std::direct_atomic_load_n(&ready_count, std::memory_order_relaxed); }
     };
 } // namespace scheduler
@@ -8,8 +8,13 @@
 #include <cstddef>
 #include <gdt/gdt.h>
 #include <idt/idt.h>
+#include <mm/mm.h>
 #include <mm/paging/paging.h>
+#include <mm/paging/tlb.h>
+#include <mm/slab.h>
+#include <mm/stats.h>
 #include <process/scheduler/scheduler.h>
+#include <timer/timer.h>
 #include <utils/id_allocator.h>
 
 namespace smp
@@ -26,11 +31,21 @@ namespace smp
 
         // a unique value from [0, smp_count) representing this core
         std::size_t core_id;
+        // the NUMA node this core sits on, the pmm prefers memory from it
+        std::size_t numa_node{};
 
         // lapic
         apic::local_apic apic;
+        std::uint32_t apic_id;
         id_allocator<256> irq_allocator;
-        paging::page_table_entry* pagemap;
+        paging::tlb_queue tlb_queue{};
+        paging::pcid_cache pcids{};
+        mm::page_cache page_cache{};
+        mm::fault_reserve fault_reserve{};
+        // set while this core holds a zone lock or changes its page cache, a fault then has to stay out of the pmm
+        bool in_pmm{};
+        mm::slab_cache slab_caches[mm::SLAB_CLASS_COUNT]{};
+        mm::mem_stats mem_stats{};
 
         // gdt
         gdt::gdt_entries gdt;
@@ -39,6 +54,9 @@ namespace smp
         // scheduler stuff
         proc::thread* current_thread;
         scheduler::scheduler scheduler;
+        timer::wheel timer_wheel;
+        // added to this core's TSC to line it up with the bootstrap core's
+        std::int64_t tsc_offset{};
 
         // misc
         std::size_t timer_tick_count{};
@@ -1,73 +1,77 @@
 #pragma once
 
 #include "spinlock.h"
-#include <atomic>
-#include <cyclic_queue>
-#include <smp/smp.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace proc
+{
+    struct thread;
+} // namespace proc
 
 namespace lock
 {
-    template<std::size_t N, bool queue_heap = false>
-    class semaphore
+    /// \brief A counting semaphore that blocks the threads waiting on it
+    ///
+    /// Waiters queue up in the order they arrived, and release() hands its token straight to the first of them, so a thread
+    /// that releases and takes the semaphore again right away cannot starve them. Without a thread to block, before the
+    /// scheduler runs or with interrupts off, waiters spin instead.
+    class semaphore_base
     {
+        // lives on the stack of the thread that waits
+        struct waiter
+        {
+            semaphore_base* owner;
+            proc::thread* thread;
+            bool granted;
+            waiter* prev;
+            waiter* next;
+        };
+
         std::size_t count;
         spinlock internal_spinlock;
-        stdext::circular_queue<proc::thread*, N, queue_heap> q;
+        waiter* head{};
+        waiter* tail{};
+
+        void push(waiter& w);
+        void remove(waiter& w);
+        // takes a token, waiting for one until deadline at most
+        auto acquire(std::uint64_t deadline) -> bool;
+
     public:
-        constexpr semaphore() : count(N) {}
-        void lock()
-        { 
-            spinlock_guard guard(internal_spinlock);
-            if(count) {
-                count--;
-            } else
-            {
-                q.push(smp::core_local::get().current_thread);
-                // resched
-            }
-        }
+        constexpr explicit semaphore_base(std::size_t count) : count(count) {}
 
-        void release()
-        {
-            spinlock_guard guard(internal_spinlock);
-            count++;
-            // scheduler stuff
-        }
+        void lock();
+        /// \brief Takes a token only if one is available right away
+        auto try_lock() -> bool;
+        /// \brief Like lock(), but gives up after \p ns nanoseconds
+        /// \return Whether a token was taken
+        auto try_lock_for(std::uint64_t ns) -> bool;
+        void release();
     };
 
-    class dynamic_semaphore
+    template <std::size_t N>
+    class semaphore : public semaphore_base
     {
-        std::size_t count;
-        spinlock internal_spinlock;
-        stdext::dynamic_circular_queue<proc::thread*> q;
     public:
-        inline dynamic_semaphore(std::size_t count) : count(count), q(count) {}
-        void lock()
-        { 
-            spinlock_guard guard(internal_spinlock);
-            if(count) {
-                count--;
-            } else
-            {
-                q.push(smp::core_local::get().current_thread);
-                // resched
-            }
-        }
+        constexpr semaphore() : semaphore_base(N) {}
+    };
 
-        void release()
-        {
-            spinlock_guard guard(internal_spinlock);
-            count++;
-            // scheduler stuff
-        }
+    class dynamic_semaphore : public semaphore_base
+    {
+    public:
+        inline dynamic_semaphore(std::size_t count) : semaphore_base(count) {}
     };
 
     class mutex
     {
         semaphore<1> s;
+
     public:
         constexpr mutex() = default;
         inline void lock() { s.lock(); }
+        inline auto try_lock() -> bool { return s.try_lock(); }
+        inline auto try_lock_for(std::uint64_t ns) -> bool { return s.try_lock_for(ns); }
         inline void release() { s.release(); }
     };
-}
+} // namespace lock
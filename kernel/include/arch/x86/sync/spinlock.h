@@ -28,6 +28,22 @@ namespace lock
         ~interrupt_lock_guard() { enable_interrupt(); }
     };
 
+    // disables interrupts, but only turns them back on if they were enabled to begin with
+    class interrupt_save_guard
+    {
+        bool enabled;
+
+    public:
+        interrupt_save_guard() : enabled((read_rflags() & cpuflags::IF) != 0) { disable_interrupt(); };
+        ~interrupt_save_guard()
+        {
+            if (enabled)
+            {
+                enable_interrupt();
+            }
+        }
+    };
+
     template <typename T>
     concept lockable = requires(T lock) {
         lock.lock();
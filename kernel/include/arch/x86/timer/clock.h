@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+namespace timer
+{
+    /// \brief Measures the TSC rate once, against the HPET or the PIT without one
+    ///
+    /// Runs on the bootstrap core before any other core is started, and with the ACPI tables mapped. Without an invariant
+    /// TSC the rate may drift with the cpu's frequency, which is logged but otherwise lived with, there is no other clock.
+    void init_clock();
+
+    /// \brief Measures how far the current core's TSC is off from the bootstrap core's, so that now_ns() corrects for it
+    ///
+    /// Every core calls this once during bring-up; the bootstrap core answers the others' probes until all of them are done.
+    void sync_clock();
+
+    /// \brief Nanoseconds since init_clock()
+    ///
+    /// Lock-free and monotonic on every core, and consistent across cores up to the error sync_clock() measured with.
+    auto now_ns() -> std::uint64_t;
+
+    /// \brief The TSC ticks per millisecond init_clock() measured
+    auto tsc_per_ms() -> std::uint64_t;
+
+    /// \brief Whether the TSC keeps a constant rate no matter the cpu's power state
+    auto clock_invariant() -> bool;
+} // namespace timer
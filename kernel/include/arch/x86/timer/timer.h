@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sync/spinlock.h>
+#include <timer/clock.h>
+
+namespace timer
+{
+    inline constexpr std::uint64_t NS_PER_MS = 1000000;
+    inline constexpr std::uint64_t NS_PER_SEC = 1000 * NS_PER_MS;
+    // a deadline that never comes
+    inline constexpr std::uint64_t NEVER = ~0UL;
+
+    // the wheel's resolution, timers expire on the first tick of 2^TICK_SHIFT ns (about 65 us) at or after their deadline
+    inline constexpr std::size_t TICK_SHIFT = 16;
+    // every level covers SLOTS times the span of the one below, six levels reach out to about 52 days
+    inline constexpr std::size_t SLOT_SHIFT = 6;
+    inline constexpr std::size_t SLOTS = 1 << SLOT_SHIFT;
+    inline constexpr std::size_t LEVELS = 6;
+
+    /// \brief A callback that runs once its deadline has passed
+    ///
+    /// Callbacks run from the timer interrupt of the core that armed them, with interrupts off, so they must not block. The
+    /// event must stay alive until it has fired or cancel() returned.
+    struct event
+    {
+        void (*callback)(event&){};
+        void* data{};
+
+        std::uint64_t deadline{};
+        event* prev{};
+        event* next{};
+        // the core whose wheel the event is queued on, and the slot on it
+        std::size_t core{};
+        std::size_t slot{};
+        bool pending{};
+    };
+
+    /// \brief The pending timers of one core
+    ///
+    /// A hierarchical timing wheel: level 0 has one slot per tick, every level above one slot per SLOTS slots of the level
+    /// below. Arming and cancelling are O(1), and a timer on a higher level is moved down a level each time the wheel reaches
+    /// the start of its slot, so it is only touched LEVELS times at most.
+    class wheel
+    {
+        lock::spinlock lock;
+        // level l, slot s is at index l * SLOTS + s
+        event* slots[LEVELS * SLOTS]{};
+        // slots with at least one event, per level
+        std::uint64_t occupied[LEVELS]{};
+        // every tick up to and including this one has been processed
+        std::uint64_t current{};
+        // what the scheduler needs the next interrupt for, and what the LAPIC timer is armed for
+        std::uint64_t tick = NEVER;
+        std::uint64_t armed = NEVER;
+        // set while run_expired() calls the callbacks it collected
+        bool expiring{};
+
+        void insert(event& ev);
+        void unlink(event& ev);
+        // the next tick at which a slot needs processing, NEVER if the wheel is empty
+        [[nodiscard]] auto next_tick() const -> std::uint64_t;
+        // processes every tick up to target, collecting the events that are due
+        void advance(std::uint64_t target, event*& due);
+        // arms the LAPIC timer for whatever comes first, the scheduler tick or the next slot
+        void program();
+
+        friend void init();
+        friend void arm(event& ev, std::uint64_t deadline);
+        friend auto cancel(event& ev) -> bool;
+        friend void run_expired();
+        friend void reprogram(std::uint64_t tick_deadline);
+    };
+
+    /// \brief Sets up the wheel of the current core
+    ///
+    /// Needs the clock to be synced on the current core first.
+    void init();
+
+    /// \brief Queues \p ev on the current core's wheel, to fire at \p deadline
+    ///
+    /// The event must not be pending already.
+    void arm(event& ev, std::uint64_t deadline);
+
+    /// \brief Takes \p ev off its wheel, from any core
+    /// \return Whether it was still pending; if not, the callback has already run
+    ///
+    /// A callback that is running right now on another core is waited for, so the event can be freed once this returns.
+    /// Must not be called from a callback.
+    auto cancel(event& ev) -> bool;
+
+    /// \brief Runs the callbacks of every event on the current core that is due
+    ///
+    /// Called from the timer interrupt.
+    void run_expired();
+
+    /// \brief Arms the LAPIC timer for whatever comes first, \p tick_deadline or the next event
+    ///
+    /// Stops it if both are NEVER. Must run with interrupts off.
+    void reprogram(std::uint64_t tick_deadline);
+
+    /// \brief Blocks the current thread until at least \p deadline
+    ///
+    /// Without a thread to block, before the scheduler runs or with interrupts off, this spins instead.
+    void sleep_until(std::uint64_t deadline);
+    inline void sleep_for(std::uint64_t ns) { sleep_until(now_ns() + ns); }
+} // namespace timer
@@ -3,5 +3,8 @@
 
 namespace user
 {
+    /// \brief Sets up a new address space for the process of \p thread with the segments of \p elf_data
+    ///
+    /// Segments are populated lazily from \p elf_data, so it must stay valid for as long as the process exists.
     auto load_elf(void* elf_data, proc::thread& thread) -> bool;
 }
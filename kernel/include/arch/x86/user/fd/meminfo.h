@@ -0,0 +1,19 @@
+#pragma once
+
+#include <user/fd/fd.h>
+
+namespace user::fd
+{
+    /// \brief A read only file with the memory statistics of every core
+    ///
+    /// Every read returns a fresh snapshot from the start, in the format of mm::format_meminfo(), truncated to the size of
+    /// the buffer.
+    class meminfo_fd final : public fd_operations
+    {
+    public:
+        [[nodiscard]] auto read(file_desc& instance, user_pointer<std::uint8_t> buffer, std::size_t count) const -> std::ssize_t override;
+        [[nodiscard]] auto write(file_desc& instance, user_pointer<const std::uint8_t> buffer, std::size_t count) const -> std::ssize_t override;
+        [[nodiscard]] auto close(file_desc& instance) const -> std::ssize_t override;
+        [[nodiscard]] auto seek(file_desc& instance, std::ssize_t offset, seek_type type) const -> std::ssize_t override;
+    };
+} // namespace user::fd
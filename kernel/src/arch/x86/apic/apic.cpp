@@ -1,15 +1,27 @@
+#include <algorithm>
 #include <apic/apic.h>
 #include <apic/apic_flag_builder.h>
 #include <asm/asm_cpp.h>
+#include <cpuid/cpuid.h>
 #include <cstdint>
 #include <klog/klog.h>
 #include <mm/mm.h>
 #include <sync/spinlock.h>
+#include <timer/timer.h>
 
 namespace apic
 {
     inline static constexpr auto PIC_DISABLE = 0xff;
 
+    namespace
+    {
+        // split up so that long delays do not overflow the multiplication
+        auto ns_to_ticks(std::uint64_t ns, std::uint64_t per_ms) -> std::uint64_t
+        {
+            return (ns / timer::NS_PER_MS) * per_ms + (ns % timer::NS_PER_MS) * per_ms / timer::NS_PER_MS;
+        }
+    } // namespace
+
     auto local_apic::check_apic() -> bool
     {
         std::uint32_t eax = 0;
@@ -33,42 +45,6 @@ namespace apic
         reg_start->siv.write(reg_start->siv.read() | SIV_APIC_SOFTWARE_ENABLE);
     }
 
-    namespace
-    {
-        inline constexpr auto TIMER_INIT_VALUE = 0xffff;
-        inline constexpr auto TIMER_AFTER_MS = 1193;
-
-        void write_pit_timer(std::uint16_t ticks)
-        {
-            outb(ioports::PIT_MODE_COMMAND, 0b00110000);
-            outb(ioports::PIT_DATA_CHAN_0, ticks);
-            outb(ioports::PIT_DATA_CHAN_0, ticks >> 8);
-        }
-
-        auto read_pit_timer() -> std::uint16_t
-        {
-            outb(ioports::PIT_MODE_COMMAND, 0);
-            unsigned count = inb(ioports::PIT_DATA_CHAN_0);
-            count |= inb(ioports::PIT_DATA_CHAN_0) << 8;
-            return count;
-        }
-
-        void wait_ms()
-        {
-            write_pit_timer(TIMER_INIT_VALUE);
-
-            while (true)
-            {
-                auto count = read_pit_timer();
-
-                if (TIMER_INIT_VALUE - count > TIMER_AFTER_MS)
-                {
-                    break;
-                }
-            }
-        }
-    } // namespace
-
     auto local_apic::calibrate() -> std::uint64_t
     {
         if (ticks_per_ms)
@@ -81,7 +57,13 @@ namespace apic
         mmio_register().inital_timer_count.write(~0U);
         mmio_register().lvt_timer.write(build_lvt_timer(lvt_timer_mode::ONE_SHOT, false, false, 0));
 
-        wait_ms();
+        // the TSC was calibrated once already, so it serves as the reference here
+        tsc_per_ms = timer::tsc_per_ms();
+        std::uint64_t tsc_end = rdtsc_ordered() + tsc_per_ms;
+        while (rdtsc_ordered() < tsc_end)
+        {
+            pause();
+        }
 
         mmio_register().lvt_timer.write(lvt_timer_reg);
         std::uint64_t ticks = ~0U - mmio_register().current_timer_count;
@@ -89,10 +71,65 @@ namespace apic
         return ticks_per_ms = ticks;
     }
 
+    void local_apic::send_ipi(std::uint32_t apic_id, std::uint8_t vector)
+    {
+        // the two halves of the icr must not be interleaved with an ipi sent from an interrupt handler
+        lock::interrupt_save_guard guard;
+        mmio_register().interrupt_command[1].write(apic_id << 24);
+        mmio_register().interrupt_command[0].write(build_icr(lvt_delivery_mode::FIXED, vector));
+
+        while ((mmio_register().interrupt_command[0].read() & ICR_SEND_PENDING) != 0)
+        {
+            pause();
+        }
+    }
+
     void local_apic::set_tick(std::uint8_t irq, std::size_t tick_ms)
     {
         mmio_register().timer_divide.write(3);
         mmio_register().inital_timer_count.write(ticks_per_ms * tick_ms);
         mmio_register().lvt_timer.write(build_lvt_timer(lvt_timer_mode::PERIODIC, false, false, irq));
     }
+
+    void local_apic::init_timer(std::uint8_t irq)
+    {
+        timer_vector = irq;
+        tsc_deadline = cpuid_info::test_feature(cpuid_info::FEATURE_TSC_DEADLINE);
+
+        if (tsc_deadline)
+        {
+            mmio_register().lvt_timer.write(build_lvt_timer(lvt_timer_mode::TSC_DEADLINE, false, false, irq));
+            // the mode switch has to land before the first deadline is written, and wrmsr does not order against mmio
+            asm volatile("mfence" : : : "memory");
+            return;
+        }
+
+        mmio_register().timer_divide.write(3);
+        mmio_register().inital_timer_count.write(0);
+        mmio_register().lvt_timer.write(build_lvt_timer(lvt_timer_mode::ONE_SHOT, false, false, irq));
+    }
+
+    void local_apic::arm_timer(std::uint64_t ns)
+    {
+        if (tsc_deadline)
+        {
+            // a deadline in the past fires right away, which is what a zero delay asks for
+            wrmsr(msr::IA32_TSC_DEADLINE, rdtsc() + ns_to_ticks(ns, tsc_per_ms));
+            return;
+        }
+
+        // a zero count would stop the timer instead
+        mmio_register().inital_timer_count.write(std::max<std::uint64_t>(std::min<std::uint64_t>(ns_to_ticks(ns, ticks_per_ms), ~0U), 1));
+    }
+
+    void local_apic::stop_timer()
+    {
+        if (tsc_deadline)
+        {
+            wrmsr(msr::IA32_TSC_DEADLINE, 0);
+            return;
+        }
+
+        mmio_register().inital_timer_count.write(0);
+    }
 } // namespace apic
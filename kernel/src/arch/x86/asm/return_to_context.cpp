@@ -1,12 +1,13 @@
 #include <asm/return_to_context.h>
 #include <asm/asm_cpp.h>
 #include <mm/mm.h>
+#include <mm/paging/tlb.h>
 #include <process/context.h>
 
 extern "C" [[noreturn]] void _return_to_context_asm(proc::context* ptr);
 
 extern "C" [[noreturn]] void return_to_context(proc::context* ptr)
 {
-    write_cr3(mm::make_physical(ptr->cr3));
+    paging::switch_table(mm::make_physical(ptr->cr3));
     _return_to_context_asm(ptr);
 }
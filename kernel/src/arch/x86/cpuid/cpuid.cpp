@@ -17,11 +17,26 @@ namespace cpuid_info
     } // namespace
 
     inline constexpr auto CPUID_PROCESSOR_BRAND_STRING_START = 0x80000002;
+    inline constexpr auto CPUID_EXTENDED_FEATURES = 7;
+    inline constexpr auto CPUID_EXTENDED_MAX = 0x80000000;
+    inline constexpr auto CPUID_POWER_MANAGEMENT = 0x80000007;
 
     void initialize_cpuglobal()
     {
         cpuid(0, &cpuid_max, vendor_buf.data(), vendor_buf.data() + 2, vendor_buf.data() + 1);
-        cpuid(1, nullptr, nullptr, features.data(), features.data() + 1);
+        cpuid(1, nullptr, nullptr, features.data() + 1, features.data());
+        if (cpuid_max >= CPUID_EXTENDED_FEATURES)
+        {
+            cpuid_ext(0, features.data() + 2, features.data() + 3, features.data() + 4);
+        }
+
+        std::uint32_t extended_max = 0;
+        cpuid(CPUID_EXTENDED_MAX, &extended_max, nullptr, nullptr, nullptr);
+        if (extended_max >= CPUID_POWER_MANAGEMENT)
+        {
+            cpuid(CPUID_POWER_MANAGEMENT, nullptr, nullptr, nullptr, features.data() + 5);
+        }
+
         for (int i = 0; i < 3; i++)
         {
             auto* ptr_start = brand_buf.data() + static_cast<std::ptrdiff_t>(i * 4);
@@ -33,5 +48,5 @@ namespace cpuid_info
 
     auto cpu_brand_string() -> const char* { return cast_ptr(brand_buf.data()); }
 
-    auto test_feature(std::size_t feature) -> bool { return (features.at(feature / 32) & (1 << (feature % 32))) != 0U; }
+    auto test_feature(std::size_t feature) -> bool { return (features.at(feature / 32) & (1U << (feature % 32))) != 0U; }
 } // namespace cpuid_info
@@ -5,7 +5,9 @@
 #include <kinit/boot_resource.h>
 #include <kinit/limine.h>
 #include <mm/mm.h>
+#include <mm/stats.h>
 #include <printf.h>
+#include <sync/spinlock.h>
 #include <tty/tty.h>
 
 namespace debug
@@ -97,4 +99,15 @@ namespace debug
             });
         }
     }
+
+    void dump_meminfo()
+    {
+        // too large for the stack of whatever is being debugged
+        static char buffer[8192];
+        static lock::spinlock buffer_lock;
+
+        lock::spinlock_guard guard(buffer_lock);
+        mm::format_meminfo(buffer, sizeof(buffer));
+        std::printf("memory statistics:\n%s", buffer);
+    }
 } // namespace debug
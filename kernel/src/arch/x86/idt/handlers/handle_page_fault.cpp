@@ -2,6 +2,7 @@
 #include <idt/handlers/handlers.h>
 #include <klog/klog.h>
 #include <misc/kassert.h>
+#include <mm/address_space.h>
 #include <mm/mm.h>
 #include <mm/paging/paging.h>
 #include <smp/smp.h>
@@ -13,6 +14,11 @@ namespace handlers
     {
         auto fault_address = read_cr2();
 
+        if (mm::handle_page_fault(fault_address, error_code))
+        {
+            return;
+        }
+
         if constexpr (config::get_val<"sanitize.address">)
         {
             // this is within asan...
@@ -24,8 +30,8 @@ namespace handlers
             }
         }
 
+        mm::stat_add(smp::core_local::get().mem_stats.faults[mm::FAULT_UNHANDLED]);
         klog::log("====================== " RED("#PF") " ======================");
-        klog::log("on-demand paging and swapping should really be something I implement...");
         klog::log("error_code=0x%llx", error_code);
         klog::log("page-fault address (cr2) = 0x%016llx", fault_address);
         debug::log_register(smp::core_local::get().ctxbuffer);
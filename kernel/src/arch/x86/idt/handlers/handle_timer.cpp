@@ -1,7 +1,10 @@
 #include "klog/klog.h"
 #include <idt/handlers/handlers.h>
+#include <mm/mm.h>
 #include <printf.h>
 #include <process/scheduler/scheduler.h>
+#include <smp/smp.h>
+#include <timer/timer.h>
 
 namespace handlers
 {
@@ -10,6 +13,10 @@ namespace handlers
         auto& local = smp::core_local::get();
         local.timer_tick_count++;
         local.apic.end();
+        // timers that wake threads up have to run first, so that the scheduler sees them ready
+        timer::run_expired();
+        // stacks that grew since the last tick took their pages from here
+        mm::refill_fault_reserve();
         local.scheduler.load_sched_task_ctx();
     }
 } // namespace handlers
@@ -0,0 +1,14 @@
+#include <idt/handlers/handlers.h>
+#include <mm/mm.h>
+#include <process/scheduler/scheduler.h>
+
+namespace handlers
+{
+    void handle_yield(std::uint64_t /*unused*/, std::uint64_t /*unused*/)
+    {
+        // raised with int by the thread itself, so there is nothing to acknowledge
+        // a thread never blocks inside the pmm, so this is a safe point to top up the fault reserve as well
+        mm::refill_fault_reserve();
+        smp::core_local::get().scheduler.load_sched_task_ctx();
+    }
+} // namespace handlers
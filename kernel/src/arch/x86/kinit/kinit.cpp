@@ -20,6 +20,7 @@
 #include <printf.h>
 #include <smp/smp.h>
 #include <sync/spinlock.h>
+#include <timer/clock.h>
 #include <tty/tty.h>
 #include <type_traits>
 #include <utility>
@@ -66,21 +67,11 @@ modules::modules()
     }
 }
 
-boot_resource::boot_resource() : mmap_length(0), pmrs_length(0), mmap_entries(), smp_status(false)
+boot_resource::boot_resource() : mmap_length(0), pmrs_length(0), mmap_source(nullptr), mmap_entries(nullptr), smp_status(false), flags(0)
 {
     auto* mmap_tag = memmap_request.response;
-
-    if (mmap_tag->entry_count > MMAP_ENTRIES)
-    {
-        flags = WARN_MMAP_OVERFLOW;
-    }
-
-    mmap_length = std::min(mmap_tag->entry_count, MMAP_ENTRIES);
-
-    for (std::size_t i = 0; i < mmap_length; i++)
-    {
-        mmap_entries[i] = *mmap_tag->entries[i];
-    }
+    mmap_length = mmap_tag->entry_count;
+    mmap_source = mmap_tag->entries;
 
     ksize = kernel_file_request.response->kernel_file->size;
     phys_addr = kernel_address_request.response->physical_base;
@@ -91,6 +82,17 @@ boot_resource::boot_resource() : mmap_length(0), pmrs_length(0), mmap_entries(),
     bsp_id_lapic = smp->bsp_lapic_id;
 }
 
+void boot_resource::copy_memmap()
+{
+    auto* entries = new limine_memmap_entry[mmap_length];
+    for (std::size_t i = 0; i < mmap_length; i++)
+    {
+        entries[i] = *mmap_source[i];
+    }
+
+    mmap_entries = entries;
+}
+
 namespace
 {
     smp::core_local cpu0;
@@ -98,7 +100,7 @@ namespace
 
     void handle_init_warnings()
     {
-        static constexpr std::pair<std::uint32_t, const char*> flags[] = {{WARN_MMAP_OVERFLOW, "mmap_overflow"}, {WARN_PMM_OVERFLOW, "pmm_overflow"}};
+        static constexpr std::pair<std::uint32_t, const char*> flags[] = {{WARN_PMM_OVERFLOW, "pmm_overflow"}};
         boot_resource& instance = boot_resource::instance();
         if (instance.warn_init())
         {
@@ -147,6 +149,7 @@ extern "C"
 
         // okay, set up core functionality to hopefully get useful information out of the kernel
         mm::init();
+        instance.copy_memmap();
         tty::init();
 
         std::printf("kinit: _start() started tty\n");
@@ -163,6 +166,7 @@ extern "C"
         });
 
         debug::dump_acpi_info();
+        timer::init_clock();
 
         // PCI time!
         // Note: this should be moved to post-smp init
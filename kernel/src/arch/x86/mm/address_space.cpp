@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <asm/asm_cpp.h>
+#include <atomic>
+#include <cstring>
+#include <misc/cast.h>
+#include <misc/kassert.h>
+#include <mm/address_space.h>
+#include <mm/mm.h>
+#include <mm/paging/paging.h>
+#include <mm/paging/tlb.h>
+#include <mm/stats.h>
+#include <process/process.h>
+#include <smp/smp.h>
+#include <utility>
+
+namespace mm
+{
+    namespace
+    {
+        // page fault error code bits
+        inline constexpr std::uint64_t PF_PRESENT = 1 << 0;
+        inline constexpr std::uint64_t PF_WRITE = 1 << 1;
+
+        inline constexpr std::uintptr_t USER_END = 0x0000800000000000;
+
+        void count_fault(fault_kind kind) { stat_add(smp::core_local::get().mem_stats.faults[kind]); }
+
+        auto current_table() -> paging::page_table_entry*
+        {
+            return make_virtual<paging::page_table_entry>(read_cr3() & paging::MASK_TABLE_POINTER);
+        }
+
+        // kernel pages reserved with paging::reserve_page
+        // a fault that interrupted the pmm, holding a zone lock or halfway through changing the page cache, is served from the
+        // core's fault reserve, every other one allocates and tops the reserve back up
+        auto handle_demand_zero(std::uintptr_t addr) -> bool
+        {
+            auto* entry = paging::lookup_entry(current_table(), addr);
+            if (entry == nullptr)
+            {
+                return false;
+            }
+
+            std::uint64_t value = std::direct_atomic_load_n(entry, std::memory_order_acquire);
+            if ((value & paging::PRESENT) != 0)
+            {
+                // another core populated it first
+                return true;
+            }
+
+            if ((value & paging::DEMAND_ZERO) == 0)
+            {
+                return false;
+            }
+
+            auto& local = smp::core_local::get();
+            auto& reserve = local.fault_reserve;
+            void* page = nullptr;
+            if (!local.in_pmm)
+            {
+                page = pmm_allocate_clean();
+                refill_fault_reserve();
+            }
+
+            bool from_reserve = page == nullptr;
+            if (from_reserve)
+            {
+                // an empty reserve means the pmm grew its stack by more than the reserve
+                if (reserve.count == 0)
+                {
+                    return false;
+                }
+
+                page = reserve.pages[reserve.count - 1];
+            }
+
+            std::uint64_t mapped = paging::make_page_small(make_physical(page), paging::get_page_prop(value));
+            if (!std::direct_atomic_compare_exchange_n(entry, &value, mapped, false, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                // another core was faster, a page from the reserve simply stays there
+                if (!from_reserve)
+                {
+                    pmm_free(page);
+                }
+
+                return true;
+            }
+
+            if (from_reserve)
+            {
+                reserve.count--;
+            }
+
+            count_fault(FAULT_KERNEL_DEMAND_ZERO);
+            return true;
+        }
+
+        // drops the reference of a user mapping, freeing the page once nothing maps it anymore
+        void release_frame(std::uint64_t entry)
+        {
+            std::uintptr_t physical_addr = entry & paging::MASK_TABLE_SMALL;
+            if ((entry & paging::EXTERNAL) == 0 && page_to_pfn(physical_addr).release() == 0)
+            {
+                pmm_free(make_virtual<void>(physical_addr));
+            }
+        }
+
+        // the physical page backing page directly, if the area's data covers it whole and is page aligned
+        auto direct_source(const paging::page_table_entry* table, const vm_area& area, std::uintptr_t page) -> std::uintptr_t
+        {
+            if (area.data_start > page || area.data_start + area.data_size < page + paging::PAGE_SMALL_SIZE)
+            {
+                return 0;
+            }
+
+            std::uintptr_t source = as_uptr(area.data) + (page - area.data_start);
+            if (source % paging::PAGE_SMALL_SIZE != 0)
+            {
+                return 0;
+            }
+
+            return paging::translate(table, source);
+        }
+
+        // copies the first count entries of a table at the given level, turning every writable leaf into a shared copy-on-write one
+        void clone_table(paging::page_table_entry* parent, paging::page_table_entry* child, int level, std::size_t count)
+        {
+            for (std::size_t i = 0; i < count; i++)
+            {
+                std::uint64_t entry = std::direct_atomic_load_n(&parent[i], std::memory_order_acquire);
+                if (level == 3)
+                {
+                    // the parent's other threads keep faulting on its entries meanwhile, so the child gets whatever the CAS left
+                    while ((entry & paging::PRESENT) != 0 && (entry & paging::RD_WR) != 0)
+                    {
+                        std::uint64_t shared = (entry & ~paging::RD_WR) | paging::COPY_ON_WRITE;
+                        if (std::direct_atomic_compare_exchange_n(&parent[i], &entry, shared, false, std::memory_order_acq_rel,
+                                                                  std::memory_order_acquire))
+                        {
+                            entry = shared;
+                        }
+                    }
+                }
+
+                if ((entry & paging::PRESENT) == 0)
+                {
+                    child[i] = entry;
+                    continue;
+                }
+
+                if (level == 3)
+                {
+                    if ((entry & paging::EXTERNAL) == 0)
+                    {
+                        page_to_pfn(entry & paging::MASK_TABLE_SMALL).acquire();
+                    }
+
+                    child[i] = entry;
+                    continue;
+                }
+
+                expect((entry & paging::PAGE_SIZE) == 0, "large pages in user space are not supported");
+                auto* table = expect_nonnull(static_cast<paging::page_table_entry*>(pmm_allocate_clean()), "cannot allocate page table");
+                stat_add(smp::core_local::get().mem_stats.page_tables_allocated);
+                clone_table(make_virtual<paging::page_table_entry>(entry & paging::MASK_TABLE_POINTER), table, level + 1, 512);
+                child[i] = (entry & ~paging::MASK_TABLE_POINTER) | make_physical(table);
+            }
+        }
+
+        void free_table(paging::page_table_entry* table, int level, std::size_t count)
+        {
+            for (std::size_t i = 0; i < count; i++)
+            {
+                std::uint64_t entry = table[i];
+                if ((entry & paging::PRESENT) == 0)
+                {
+                    continue;
+                }
+
+                if (level == 3)
+                {
+                    release_frame(entry);
+                    continue;
+                }
+
+                auto* next = make_virtual<paging::page_table_entry>(entry & paging::MASK_TABLE_POINTER);
+                free_table(next, level + 1, 512);
+                pmm_free(next);
+                stat_add(smp::core_local::get().mem_stats.page_tables_freed);
+            }
+        }
+    } // namespace
+
+    address_space::address_space() : table(as_ptr(expect_nonnull(pmm_allocate_clean(), "cannot allocate page table")))
+    {
+        paging::copy_kernel_page_tables(table, paging::kernel_table());
+        stat_add(smp::core_local::get().mem_stats.page_tables_allocated);
+    }
+
+    address_space::~address_space()
+    {
+        paging::release_pcid(make_physical(table));
+        free_table(table, 0, 256);
+        pmm_free(table);
+        stat_add(smp::core_local::get().mem_stats.page_tables_freed);
+    }
+
+    void address_space::add_area(const vm_area& area)
+    {
+        lock::spinlock_guard guard(lock);
+        areas.push_back(area);
+
+        for (std::size_t i = areas.size() - 1; i > 0 && areas[i - 1].start > areas[i].start; i--)
+        {
+            std::swap(areas[i - 1], areas[i]);
+        }
+    }
+
+    auto address_space::clone() -> address_space*
+    {
+        auto* child = new address_space();
+
+        {
+            lock::spinlock_guard guard(lock);
+            child->areas = areas;
+            clone_table(table, child->table, 0, 256);
+        }
+
+        // everything we share is read-only now, drop the writable translations any core may still have cached
+        paging::flush_tlb_range(0, USER_END / paging::PAGE_SMALL_SIZE);
+        return child;
+    }
+
+    auto address_space::populate(std::uintptr_t page, bool write) -> bool
+    {
+        std::size_t overlapping = 0;
+        bool has_data = false;
+        const vm_area* last = nullptr;
+        paging::page_prop prop{.rw = false, .us = true, .x = false};
+
+        // processes only have a handful of areas, so a scan is cheaper than anything smarter
+        for (const auto& area : areas)
+        {
+            if (area.start >= page + paging::PAGE_SMALL_SIZE)
+            {
+                break;
+            }
+
+            if (area.end <= page)
+            {
+                continue;
+            }
+
+            overlapping++;
+            last = &area;
+            prop.rw |= area.prop.rw;
+            prop.x |= area.prop.x;
+            has_data |= area.data_start < page + paging::PAGE_SMALL_SIZE && area.data_start + area.data_size > page;
+        }
+
+        if (overlapping == 0)
+        {
+            return false;
+        }
+
+        // until they are written to, whole pages of the image are mapped straight from it and untouched zero-filled memory
+        // shares the zero page
+        if (!write)
+        {
+            std::uintptr_t source = overlapping == 1 ? direct_source(table, *last, page) : 0;
+            if (source != 0 || !has_data)
+            {
+                map_external(page, source != 0 ? source : zero_page(), prop);
+                return true;
+            }
+        }
+
+        void* frame = pmm_allocate_clean();
+        if (frame == nullptr)
+        {
+            return false;
+        }
+
+        for (const auto& area : areas)
+        {
+            if (area.start >= page + paging::PAGE_SMALL_SIZE)
+            {
+                break;
+            }
+
+            std::uintptr_t from = std::max(page, area.data_start);
+            std::uintptr_t to = std::min(page + paging::PAGE_SMALL_SIZE, area.data_start + area.data_size);
+            if (area.end > page && from < to)
+            {
+                std::memcpy(static_cast<std::uint8_t*>(frame) + (from - page), static_cast<const std::uint8_t*>(area.data) + (from - area.data_start),
+                            to - from);
+            }
+        }
+
+        page_to_pfn(frame).set_refcount(1);
+        if (!paging::map_page_for(table, paging::SMALL, page, make_physical(frame), prop, false))
+        {
+            // somebody else mapped it while we were waiting for the lock
+            pmm_free(frame);
+        }
+
+        return true;
+    }
+
+    void address_space::map_external(std::uintptr_t page, std::uintptr_t physical_addr, paging::page_prop prop)
+    {
+        // the entry has to be complete when it is published, a fault on another core could see it right away
+        std::uint64_t flags = paging::EXTERNAL | (prop.rw ? paging::COPY_ON_WRITE : 0);
+        prop.rw = false;
+        paging::map_page_for(table, paging::SMALL, page, physical_addr, prop, false, flags);
+    }
+
+    auto address_space::break_cow(std::uintptr_t page, std::uint64_t& replaced) -> bool
+    {
+        auto* entry = paging::lookup_entry(table, page);
+        if (entry == nullptr || (*entry & paging::PRESENT) == 0)
+        {
+            return false;
+        }
+
+        if ((*entry & paging::RD_WR) != 0)
+        {
+            // another thread got here first, we only had a stale translation
+            invlpg(page);
+            return true;
+        }
+
+        if ((*entry & paging::COPY_ON_WRITE) == 0)
+        {
+            return false;
+        }
+
+        std::uintptr_t physical_addr = *entry & paging::MASK_TABLE_SMALL;
+        auto prop = paging::get_page_prop(*entry);
+        prop.rw = true;
+
+        if ((*entry & paging::EXTERNAL) == 0 && page_to_pfn(physical_addr).get_refcount() == 1)
+        {
+            // every other sharer is gone, so the page is ours to write
+            *entry = paging::make_page_small(physical_addr, prop);
+            invlpg(page);
+            count_fault(FAULT_COW_REUSE);
+        }
+        else
+        {
+            void* frame = physical_addr == zero_page() ? pmm_allocate_clean() : pmm_allocate();
+            if (frame == nullptr)
+            {
+                return false;
+            }
+
+            if (physical_addr != zero_page())
+            {
+                std::memcpy(frame, make_virtual<void>(physical_addr), paging::PAGE_SMALL_SIZE);
+            }
+
+            page_to_pfn(frame).set_refcount(1);
+            replaced = std::exchange(*entry, paging::make_page_small(make_physical(frame), prop));
+            count_fault(FAULT_COW_COPY);
+        }
+
+        return true;
+    }
+
+    auto address_space::handle_fault(std::uintptr_t addr, std::uint64_t error_code) -> bool
+    {
+        std::uintptr_t page = addr & ~(paging::PAGE_SMALL_SIZE - 1);
+        std::uint64_t replaced = 0;
+
+        {
+            lock::spinlock_guard guard(lock);
+            if ((error_code & PF_PRESENT) == 0)
+            {
+                if (!populate(page, (error_code & PF_WRITE) != 0))
+                {
+                    return false;
+                }
+
+                count_fault(FAULT_USER_POPULATE);
+                return true;
+            }
+
+            if ((error_code & PF_WRITE) == 0 || !break_cow(page, replaced))
+            {
+                return false;
+            }
+        }
+
+        // other threads may still read the old page through a stale translation, so it can only be released once every
+        // core has dropped it; the shootdown happens without the lock so that cores spinning on it can take the IPI
+        if (replaced != 0)
+        {
+            paging::flush_tlb_range(page, 1);
+            release_frame(replaced);
+        }
+
+        return true;
+    }
+
+    auto handle_page_fault(std::uintptr_t addr, std::uint64_t error_code) -> bool
+    {
+        if (addr >= USER_END)
+        {
+            return (error_code & PF_PRESENT) == 0 && handle_demand_zero(addr);
+        }
+
+        auto* thread = smp::core_local::get().current_thread;
+        if (thread == nullptr)
+        {
+            return false;
+        }
+
+        auto* space = proc::get_process(thread->id.proc).get_address_space();
+        return space != nullptr && space->handle_fault(addr, error_code);
+    }
+} // namespace mm
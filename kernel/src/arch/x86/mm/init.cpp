@@ -1,11 +1,14 @@
 #include <bits/mathhelper.h>
 #include <config.h>
 #include <cstddef>
+#include <cstring>
 #include <debug/debug.h>
 #include <kinit/boot_resource.h>
 #include <kinit/limine.h>
+#include <misc/kassert.h>
 #include <mm/malloc.h>
 #include <mm/mm.h>
+#include <mm/numa.h>
 #include <mm/paging/paging.h>
 #include <mm/paging/paging_entries.h>
 
@@ -16,15 +19,30 @@ namespace mm
         std::size_t stupid_pmm_current_index = 0;
         std::size_t stupid_pmm_offset = 0;
         std::size_t allocations;
+        std::uintptr_t zero_page_addr;
+
+        // one bit per PFN section, a single page covers everything a page_info index can reach
+        inline constexpr std::size_t MAX_PFN_SECTIONS = paging::PAGE_SMALL_SIZE * 8;
+        std::uint64_t* present_sections;
+
+        auto section_present(std::size_t section) -> bool { return (present_sections[section / 64] & (1UL << (section % 64))) != 0; }
     } // namespace
 
+    auto zero_page() -> std::uintptr_t { return zero_page_addr; }
+
+    auto pfn_valid(std::size_t index) -> bool
+    {
+        std::size_t section = index / PFN_SECTION_PAGES;
+        return section < MAX_PFN_SECTIONS && section_present(section);
+    }
+
     auto pmm_stupid_allocate() -> void*
     {
         allocations++;
-        const auto& entries = boot_resource::instance().memmap();
-        const auto& entry_count = boot_resource::instance().memmap_length();
+        const auto& resource = boot_resource::instance();
+        std::size_t entry_count = resource.memmap_length();
 
-        while (entries[stupid_pmm_current_index].type != LIMINE_MEMMAP_USABLE && stupid_pmm_current_index < entry_count)
+        while (stupid_pmm_current_index < entry_count && resource.memmap_entry(stupid_pmm_current_index).type != LIMINE_MEMMAP_USABLE)
         {
             stupid_pmm_current_index++;
         }
@@ -34,7 +52,7 @@ namespace mm
             debug::panic("cannot allocate physical memory for paging");
         }
 
-        const auto& entry = entries[stupid_pmm_current_index];
+        const auto& entry = resource.memmap_entry(stupid_pmm_current_index);
 
         std::size_t max_off = entry.length / paging::PAGE_SMALL_SIZE;
         auto ptr = entry.base + stupid_pmm_offset * paging::PAGE_SMALL_SIZE;
@@ -55,18 +73,17 @@ namespace mm
         // wrmsr(msr::IA32_PAT, 0x706050403020100);
 
         std::size_t kernel_pages = std::div_roundup(boot_resource::instance().kernel_size(), paging::PAGE_SMALL_SIZE);
+        paging::init_kernel_table();
+        numa_init();
 
-        for (std::size_t i = 0; i < kernel_pages + 0x10; i++)
-        {
-            std::uint64_t vaddr = config::get_val<"mmap.start.kernel"> + i * paging::PAGE_SMALL_SIZE;
-            paging::request_page_early(paging::SMALL, vaddr, mm::make_physical_kern(vaddr), {.x = true}, true);
-        }
+        auto map_kernel_image = [](std::uintptr_t start, std::size_t pages) {
+            paging::map_range(
+                paging::kernel_table(), start, [start](std::size_t i) { return mm::make_physical_kern(start + i * paging::PAGE_SMALL_SIZE); },
+                pages, {.x = true}, true, true);
+        };
 
-        for (std::size_t i = 0; i < 10; i++)
-        {
-            std::uint64_t vaddr = 0xffffffff90000000 + i * paging::PAGE_SMALL_SIZE;
-            paging::request_page_early(paging::SMALL, vaddr, mm::make_physical_kern(vaddr), {.x = true}, true);
-        }
+        map_kernel_image(config::get_val<"mmap.start.kernel">, kernel_pages + 0x10);
+        map_kernel_image(0xffffffff90000000, 10);
 
         boot_resource::instance().iterate_mmap([](const limine_memmap_entry& e) {
             paging::page_prop flags;
@@ -90,85 +107,65 @@ namespace mm
             paging::map_hhdm_section_early(e.base, e.length, flags);
         });
 
-        for (std::size_t i = 0; i < config::get_val<"preallocate-pages">; i++)
-        {
-            void* ptr = mm::pmm_stupid_allocate();
-            if (ptr == nullptr)
-            {
-                debug::panic("cannot get memory for heap");
-            }
-            paging::request_page_early(paging::page_type::SMALL, config::get_val<"mmap.start.heap"> + i * paging::PAGE_SMALL_SIZE,
-                                       mm::make_physical(ptr));
-        }
+        paging::map_range(
+            paging::kernel_table(), config::get_val<"mmap.start.heap">,
+            [](std::size_t) {
+                void* ptr = mm::pmm_stupid_allocate();
+                if (ptr == nullptr)
+                {
+                    debug::panic("cannot get memory for heap");
+                }
+
+                return mm::make_physical(ptr);
+            },
+            config::get_val<"preallocate-pages">, {}, false, true);
 
         // okay, now it's time to set up the PFN table
-        // two phase: we first map everything, then actually setup PFN
-        void* current_page = nullptr;
-        boot_resource::instance().iterate_mmap([&](const limine_memmap_entry& e) {
-            if (e.type != LIMINE_MEMMAP_USABLE)
+        // two phase: we first map every section that has usable memory in it, then the pmm sets up the entries
+        present_sections = as_ptr(pmm_stupid_allocate());
+        std::memset(present_sections, 0, paging::PAGE_SMALL_SIZE);
+
+        boot_resource::instance().iterate_mmap([](const limine_memmap_entry& e) {
+            if (e.type != LIMINE_MEMMAP_USABLE || e.length == 0)
             {
                 return;
             }
 
-            auto start = e.base;
-
-            // so we need to map from pfn_addr(start) to pfn_addr(start) + (e.length / PAGE_SMALL_SIZE) * sizeof(page_info)
-
-            auto pfn_start = start / paging::PAGE_SMALL_SIZE * sizeof(page_info);
-            auto pfn_end = pfn_start + (e.length / paging::PAGE_SMALL_SIZE) * sizeof(page_info);
-
-            std::size_t page_start = pfn_start / paging::PAGE_SMALL_SIZE;
-            std::size_t page_end = std::div_roundup(pfn_end, paging::PAGE_SMALL_SIZE);
-
-            for (std::size_t i = page_start; i < page_end; i++)
+            std::size_t first = e.base / paging::PAGE_SMALL_SIZE / PFN_SECTION_PAGES;
+            std::size_t last = (e.base + e.length - 1) / paging::PAGE_SMALL_SIZE / PFN_SECTION_PAGES;
+            for (std::size_t section = first; section <= last; section++)
             {
-                if (current_page == nullptr)
+                expect(section < MAX_PFN_SECTIONS, "pfn: usable memory past the last PFN section");
+                if (section_present(section))
                 {
-                    current_page = pmm_stupid_allocate();
-                    if (current_page == nullptr)
-                    {
-                        debug::panic("failed to allocate physical memory");
-                    }
+                    continue;
                 }
 
-                if (paging::request_page_early(paging::SMALL, i * paging::PAGE_SMALL_SIZE + config::get_val<"mmap.start.pfn">,
-                                               make_physical(current_page)))
-                {
-                    current_page = nullptr;
-                }
+                present_sections[section / 64] |= 1UL << (section % 64);
+                paging::map_range(
+                    paging::kernel_table(), config::get_val<"mmap.start.pfn"> + section * paging::PAGE_MEDIUM_SIZE,
+                    [](std::size_t) { return make_physical(pmm_stupid_allocate()); }, paging::PAGE_MEDIUM_TO_SMALL_RATIO, {}, false, true);
             }
         });
 
         // we want to switch to our tables now...
         paging::install();
 
-        // now we set PFN table
+        // now we hand every page that the early allocator hasn't consumed to the pmm
         std::size_t mmap_index = 0;
         boot_resource::instance().iterate_mmap([&](const limine_memmap_entry& e) {
-            if (e.type != LIMINE_MEMMAP_USABLE)
+            std::size_t index = mmap_index++;
+            if (e.type != LIMINE_MEMMAP_USABLE || index < stupid_pmm_current_index)
             {
                 return;
             }
 
-            // TODO: ddd this to some used list if condition isn't met?
-            if (mmap_index >= stupid_pmm_current_index)
-            {
-                std::size_t start_index = 0;
-                if (mmap_index == stupid_pmm_current_index)
-                {
-                    start_index = stupid_pmm_offset;
-                }
-
-                for (; start_index < e.length / paging::PAGE_SMALL_SIZE; start_index++)
-                {
-                    new (&page_to_pfn(e.base + start_index * paging::PAGE_SMALL_SIZE)) page_info();
-                    pmm_get_free_list().add_front(&page_to_pfn(e.base + start_index * paging::PAGE_SMALL_SIZE));
-                }
-            }
-
-            mmap_index++;
+            std::size_t consumed = index == stupid_pmm_current_index ? stupid_pmm_offset * paging::PAGE_SMALL_SIZE : 0;
+            pmm_add_region(e.base + consumed, e.length - consumed);
         });
 
+        zero_page_addr = make_physical(expect_nonnull(pmm_allocate_clean(), "cannot allocate the zero page"));
+
         alloc::init(as_vptr(config::get_val<"mmap.start.heap">), paging::PAGE_SMALL_SIZE * config::get_val<"preallocate-pages">);
     }
 } // namespace mm
@@ -1,229 +1,405 @@
 #include "bits/mathhelper.h"
+#include <algorithm>
 #include <asm/asm_cpp.h>
+#include <atomic>
 #include <config.h>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <debug/debug.h>
 #include <gsl/pointer>
+#include <misc/kassert.h>
+#include <mm/malloc.h>
 #include <mm/mm.h>
 #include <new>
 #include <mm/paging/paging.h>
 
+// the heap is a TLSF allocator: blocks keep the boundary tag layout (size + pointer to the previous block),
+// and free blocks are indexed by a two level bitmap of segregated lists, so both malloc and free run in constant time
 namespace alloc
 {
     struct block_header
     {
+        // if the least significant bit == 0 : alloc
+        //                              == 1 : free
         std::size_t size;
         block_header* back;
     };
 
+    // free blocks link themselves into their size class through the start of their payload
+    struct free_node
+    {
+        block_header* prev;
+        block_header* next;
+    };
+
     namespace
     {
+        inline constexpr std::size_t ALIGN = 16;
+        inline constexpr std::size_t FREE = 1;
+        inline constexpr std::size_t MIN_BLOCK = sizeof(block_header) + ALIGN;
+
+        // each power of two range is split into 2^SL_LOG2 linearly spaced lists
+        // sizes below SMALL_BLOCK all share the first level list 0, at ALIGN granularity
+        inline constexpr std::size_t SL_LOG2 = 4;
+        inline constexpr std::size_t SL_COUNT = 1 << SL_LOG2;
+        inline constexpr std::size_t FL_SHIFT = SL_LOG2 + std::ceil_logbase2(ALIGN);
+        inline constexpr std::size_t SMALL_BLOCK = 1 << FL_SHIFT;
+        inline constexpr std::size_t FL_COUNT = std::ceil_logbase2(config::get_val<"mmap.size.heap">) - FL_SHIFT + 2;
+
+        static_assert(sizeof(free_node) <= ALIGN);
+        static_assert(FL_COUNT <= 64);
+
         block_header* root = nullptr;
         block_header* last = nullptr;
+        std::uintptr_t heap_end = 0;
         std::size_t malloced_bytes = 0;
+        std::size_t free_bytes = 0;
+        std::size_t free_blocks = 0;
+
+        std::uint64_t fl_bitmap = 0;
+        std::uint32_t sl_bitmap[FL_COUNT];
+        block_header* free_lists[FL_COUNT][SL_COUNT];
     } // namespace
-    inline constexpr auto ALIGN = 16;
 
-    inline static block_header* next_of(block_header* header) { return as_ptr(as_uptr(header) + sizeof(block_header) + (header->size & ~1)); }
+    inline static auto block_size(block_header* header) -> std::size_t { return header->size & ~FREE; }
+    inline static auto is_free(block_header* header) -> bool { return (header->size & FREE) != 0; }
+    inline static auto node_of(block_header* header) -> free_node* { return as_ptr<free_node>(header + 1); }
+    inline static block_header* next_of(block_header* header) { return as_ptr(as_uptr(header) + sizeof(block_header) + block_size(header)); }
 
-    inline static auto extend(void* buf, std::size_t size) -> std::size_t
+    namespace
     {
-        std::size_t pages = std::div_roundup(size, paging::PAGE_SMALL_SIZE);
+        INLINE auto floor_log2(std::size_t size) -> std::size_t { return 63 - __builtin_clzl(size); }
 
-        for (std::size_t i = 0; i < pages; i++)
+        // maps a size to the list it is stored in
+        INLINE void mapping_insert(std::size_t size, std::size_t& fl, std::size_t& sl)
         {
-            void* buf = mm::pmm_allocate();
-            if (buf == nullptr)
+            if (size < SMALL_BLOCK)
             {
-                debug::panic("cannot get memory for heap");
+                fl = 0;
+                sl = size / (SMALL_BLOCK / SL_COUNT);
+            }
+            else
+            {
+                std::size_t log2 = floor_log2(size);
+                fl = log2 - FL_SHIFT + 1;
+                sl = (size >> (log2 - SL_LOG2)) ^ SL_COUNT;
             }
-            paging::request_page(paging::page_type::SMALL, as_uptr(buf) + i * paging::PAGE_SIZE, mm::make_physical(buf));
-            invlpg(as_vptr(as_uptr(buf) + i * paging::PAGE_SMALL_SIZE));
         }
 
-        return paging::PAGE_SMALL_SIZE * pages;
-    }
-
-    void init(void* ptr, std::size_t size) { root = last = new (ptr) block_header{(size - sizeof(block_header)) | 1, nullptr}; }
+        // maps a size to the first list where every block is guaranteed to be large enough
+        INLINE void mapping_search(std::size_t size, std::size_t& fl, std::size_t& sl)
+        {
+            if (size >= SMALL_BLOCK)
+            {
+                size += (1UL << (floor_log2(size) - SL_LOG2)) - 1;
+            }
 
-    auto get_alloced_size() -> std::size_t { return malloced_bytes; }
+            mapping_insert(size, fl, sl);
+        }
 
-    auto malloc(std::size_t size) -> void*
-    {
-        size = (size + (ALIGN - 1)) & ~(ALIGN - 1);
-        if (!size)
+        void insert_free(block_header* header)
         {
-            return nullptr;
+            std::size_t fl = 0;
+            std::size_t sl = 0;
+            mapping_insert(block_size(header), fl, sl);
+
+            auto* node = node_of(header);
+            node->prev = nullptr;
+            node->next = free_lists[fl][sl];
+            if (node->next != nullptr)
+            {
+                node_of(node->next)->prev = header;
+            }
+
+            free_lists[fl][sl] = header;
+            fl_bitmap |= 1UL << fl;
+            sl_bitmap[fl] |= 1U << sl;
+
+            free_bytes += block_size(header);
+            free_blocks++;
         }
 
-        malloced_bytes += size;
+        void remove_free(block_header* header)
+        {
+            std::size_t fl = 0;
+            std::size_t sl = 0;
+            mapping_insert(block_size(header), fl, sl);
+
+            auto* node = node_of(header);
+            if (node->prev != nullptr)
+            {
+                node_of(node->prev)->next = node->next;
+            }
+            else
+            {
+                free_lists[fl][sl] = node->next;
+            }
+
+            if (node->next != nullptr)
+            {
+                node_of(node->next)->prev = node->prev;
+            }
+
+            free_bytes -= block_size(header);
+            free_blocks--;
+
+            if (free_lists[fl][sl] == nullptr)
+            {
+                sl_bitmap[fl] &= ~(1U << sl);
+                if (sl_bitmap[fl] == 0)
+                {
+                    fl_bitmap &= ~(1UL << fl);
+                }
+            }
+        }
 
-        block_header* hdr = root;
-        while (hdr <= last)
+        auto find_free(std::size_t size) -> block_header*
         {
-            // if the least significant bit == 0 : alloc
-            //                              == 1 : free
-            if ((hdr->size & 1) && (hdr->size & ~1) >= size)
+            std::size_t fl = 0;
+            std::size_t sl = 0;
+            mapping_search(size, fl, sl);
+
+            if (fl >= FL_COUNT)
             {
-                std::size_t bsize = hdr->size & ~1;
-                if (bsize - size > sizeof(block_header))
+                return nullptr;
+            }
+
+            std::uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+            if (sl_map == 0)
+            {
+                std::uint64_t fl_map = fl + 1 < FL_COUNT ? fl_bitmap & (~0UL << (fl + 1)) : 0;
+                if (fl_map == 0)
                 {
-                    hdr->size = size;
-                    gsl::owner<block_header*> next_block = new (next_of(hdr)) block_header{(bsize - size - sizeof(block_header)) | 1, hdr};
-
-                    if (hdr == last)
-                    {
-                        last = next_block;
-                    }
-                    else
-                    {
-                        next_of(next_block)->back = next_block;
-                    }
+                    return nullptr;
                 }
 
-                hdr->size &= ~1;
-                return (void*)++hdr;
+                fl = __builtin_ctzl(fl_map);
+                sl_map = sl_bitmap[fl];
             }
-            hdr = next_of(hdr);
+
+            return free_lists[fl][__builtin_ctz(sl_map)];
         }
 
-        // extend memory and try to do stuff???
-        std::size_t new_size = extend((void*)next_of(last), size + 0x100) & ~7;
-        if ((last->size & 1) == 0)
+        // points the block after header back at it, or makes header the last block
+        void link_next(block_header* header)
         {
-            auto* u = new (next_of(last)) block_header{size & ~1, last};
-            auto* l = new (next_of(u)) block_header{(new_size - size - 2 * sizeof(block_header)) | 1, u};
-            last = l;
-            return (void*)++u;
+            if (as_uptr(next_of(header)) < heap_end)
+            {
+                next_of(header)->back = header;
+            }
+            else
+            {
+                last = header;
+            }
         }
-        else
+
+        // marks a block as free, merges it with its free neighbours and puts it on the right list
+        auto release(block_header* header) -> block_header*
         {
-            std::size_t bsize = ((last->size & ~1) + new_size) - sizeof(block_header) - size;
-            last->size = size;
-            auto* l = new (next_of(last)) block_header{bsize | 1, last};
-            last->size = size;
-            auto* u = last;
-            last = l;
-            return (void*)++u;
+            header->size &= ~FREE;
+
+            if (header != last && is_free(next_of(header)))
+            {
+                block_header* next = next_of(header);
+                remove_free(next);
+                header->size += sizeof(block_header) + block_size(next);
+            }
+
+            if (header->back != nullptr && is_free(header->back))
+            {
+                block_header* prev = header->back;
+                remove_free(prev);
+                prev->size = block_size(prev) + sizeof(block_header) + block_size(header);
+                header = prev;
+            }
+
+            link_next(header);
+            header->size |= FREE;
+            insert_free(header);
+            return header;
         }
-    }
 
-    auto aligned_malloc(std::size_t size, std::size_t align) -> void*
-    {
-        if (align <= ALIGN)
+        // shrinks an allocated block to size, giving the remainder back to the heap if it is large enough to be a block
+        void split(block_header* header, std::size_t size)
         {
-            return malloc(size);
+            std::size_t bsize = block_size(header);
+            if (bsize - size < MIN_BLOCK)
+            {
+                return;
+            }
+
+            header->size = size;
+            auto* rest = new (next_of(header)) block_header{bsize - size - sizeof(block_header), header};
+            link_next(rest);
+            release(rest);
+        }
+
+        // maps more memory at the end of the heap, and returns the free block at the tail that covers at least size bytes
+        // the heap always grows up to a 2 MiB boundary, so that everything past the first one is backed by large pages
+        auto extend(std::size_t size) -> block_header*
+        {
+            std::uintptr_t new_end = std::div_roundup(heap_end + size + sizeof(block_header), paging::PAGE_MEDIUM_SIZE) * paging::PAGE_MEDIUM_SIZE;
+            std::size_t pages = (new_end - heap_end) / paging::PAGE_SMALL_SIZE;
+            expect(new_end <= config::get_val<"mmap.start.heap"> + config::get_val<"mmap.size.heap">, "heap: out of address space");
+
+            mm::map_fresh_pages(heap_end, pages, false);
+
+            auto* tail = new (as_vptr(heap_end)) block_header{pages * paging::PAGE_SMALL_SIZE - sizeof(block_header), last};
+            heap_end += pages * paging::PAGE_SMALL_SIZE;
+            last = tail;
+            return release(tail);
         }
+    } // namespace
+
+    void init(void* ptr, std::size_t size)
+    {
+        heap_end = as_uptr(ptr) + size;
+        root = last = new (ptr) block_header{(size - sizeof(block_header)) | FREE, nullptr};
+        insert_free(root);
+    }
 
-        auto ptr = as_uptr(malloc(align + size));
-        std::uintptr_t aligned_ptr = std::div_roundup(ptr, align);
+    auto get_alloced_size() -> std::size_t { return malloced_bytes; }
 
-        if (ptr != align)
+    auto get_heap_info() -> heap_info
+    {
+        std::size_t largest = 0;
+        std::uint64_t fl_map = std::direct_atomic_load_n(&fl_bitmap, std::memory_order_relaxed);
+        if (fl_map != 0)
         {
-            // insert unaligned pointer back to real root
-            as_ptr<std::uintptr_t>(aligned_ptr)[-1] = ptr | 1;
+            // blocks within a list are only roughly the same size, the head stands in for all of them
+            std::size_t fl = 63 - __builtin_clzl(fl_map);
+            std::uint32_t sl_map = std::direct_atomic_load_n(&sl_bitmap[fl], std::memory_order_relaxed);
+            block_header* head = sl_map != 0 ? std::direct_atomic_load_n(&free_lists[fl][31 - __builtin_clz(sl_map)], std::memory_order_relaxed) : nullptr;
+            largest = head != nullptr ? block_size(head) : 0;
         }
 
-        return as_ptr(aligned_ptr);
+        return {
+            .size = heap_end - as_uptr(root),
+            .used = malloced_bytes,
+            .free = free_bytes,
+            .free_blocks = free_blocks,
+            .largest_free = largest,
+        };
     }
 
-    auto realloc(void* buf, std::size_t size) -> void*
+    auto malloc(std::size_t size) -> void*
     {
-        block_header* hdr = as_ptr<block_header>(buf) - 1;
-        if (hdr->size > size)
+        size = (size + (ALIGN - 1)) & ~(ALIGN - 1);
+        if (!size)
         {
-            return buf;
+            return nullptr;
         }
 
-        char* src = as_ptr(buf);
-        char* target = as_ptr(malloc(size + 16));
-        for (std::size_t i = 0; i < hdr->size; i++)
+        block_header* hdr = find_free(size);
+        if (hdr == nullptr)
         {
-            target[i] = src[i];
+            hdr = extend(size);
         }
-        return target;
+
+        remove_free(hdr);
+        hdr->size &= ~FREE;
+        split(hdr, size);
+
+        malloced_bytes += block_size(hdr);
+        return (void*)++hdr;
     }
 
-    void free(void* buffer)
+    auto aligned_malloc(std::size_t size, std::size_t align) -> void*
     {
-        if (buffer == nullptr)
+        if (align <= ALIGN)
         {
-            return;
+            return malloc(size);
+        }
+
+        // over-allocate so that the gap in front of the aligned address can always be split off as its own block
+        auto* hdr = as_ptr<block_header>(malloc(size + align + MIN_BLOCK)) - 1;
+        std::uintptr_t payload = as_uptr(hdr + 1);
+        std::uintptr_t aligned = std::div_roundup(payload, align) * align;
+        std::size_t rounded = (size + (ALIGN - 1)) & ~(ALIGN - 1);
+
+        if (aligned == payload)
+        {
+            // nothing to split off in front, but the over-allocation behind still goes back
+            malloced_bytes -= block_size(hdr);
+            split(hdr, rounded);
+            malloced_bytes += block_size(hdr);
+            return as_vptr(aligned);
         }
 
-        if (as_ptr<std::uintptr_t>(buffer)[-1])
+        while (aligned - payload < MIN_BLOCK)
         {
-            buffer = as_vptr(as_ptr<std::uintptr_t>(buffer)[-1] & ~1);
+            aligned += align;
         }
 
-        auto* type = as_ptr<std::size_t>(buffer) - 1;
-        auto* hdr = as_ptr<block_header>(buffer) - 1;
+        malloced_bytes -= block_size(hdr);
 
-        malloced_bytes -= hdr->size;
+        auto* aligned_hdr = new (as_vptr(aligned - sizeof(block_header))) block_header{payload + block_size(hdr) - aligned, hdr};
+        hdr->size = aligned - payload - sizeof(block_header);
+        link_next(aligned_hdr);
+        release(hdr);
 
-        if (*type & 2)
+        split(aligned_hdr, rounded);
+        malloced_bytes += block_size(aligned_hdr);
+        return as_vptr(aligned);
+    }
+
+    auto realloc(void* buf, std::size_t size) -> void*
+    {
+        if (buf == nullptr)
         {
-            hdr = as_ptr(*type);
+            return malloc(size);
         }
 
-        bool is_prev = hdr->back ? hdr->back->size & 1 : false;
-        bool is_next = hdr != last ? next_of(hdr)->size & 1 : false;
-        block_header* prev = hdr->back;
-        block_header* next = next_of(hdr);
+        size = std::max<std::size_t>((size + (ALIGN - 1)) & ~(ALIGN - 1), ALIGN);
+
+        block_header* hdr = as_ptr<block_header>(buf) - 1;
+        std::size_t old_size = block_size(hdr);
+        malloced_bytes -= old_size;
 
-        if (is_prev && is_next)
+        if (size > old_size)
         {
-            prev->size = (prev->size & ~1) + (hdr->size & ~1) + (next->size & ~1) + 2 * sizeof(block_header);
-            prev->size |= 1;
+            block_header* next = hdr != last ? next_of(hdr) : nullptr;
+            std::size_t available = next != nullptr && is_free(next) ? sizeof(block_header) + block_size(next) : 0;
 
-            // update the back pointer of the block after next
-            if (next_of(next) <= last)
+            // at the end of the heap, map just enough for the block to grow into
+            if (old_size + available < size && (next == nullptr || (next == last && available != 0)))
             {
-                next_of(next)->back = prev;
+                extend(size - old_size - available);
+                next = next_of(hdr);
+                available = sizeof(block_header) + block_size(next);
             }
 
-            if (next == last)
+            if (old_size + available < size)
             {
-                last = prev;
-            }
-        }
-        else if (is_prev)
-        {
-            prev->size = (prev->size & ~1) + (hdr->size & ~1) + sizeof(block_header);
-            prev->size |= 1;
+                malloced_bytes += old_size;
 
-            // same logic as before
-            if (next <= last)
-            {
-                next->back = prev;
+                void* target = malloc(size);
+                std::memcpy(target, buf, old_size);
+                free(buf);
+                return target;
             }
 
-            if (hdr == last)
-            {
-                last = prev;
-            }
+            remove_free(next);
+            hdr->size = old_size + available;
+            link_next(hdr);
         }
-        else if (is_next)
-        {
-            hdr->size = (hdr->size & ~1) + (next->size & ~1) + sizeof(block_header);
-            hdr->size |= 1;
 
-            // same logic as before
-            if (next_of(next) <= last)
-            {
-                next_of(next)->back = hdr;
-            }
+        // also shrinks the block if it's now larger than needed
+        split(hdr, size);
+        malloced_bytes += block_size(hdr);
+        return buf;
+    }
 
-            if (next == last)
-            {
-                last = hdr;
-            }
-        }
-        else
+    void free(void* buffer)
+    {
+        if (buffer == nullptr)
         {
-            hdr->size |= 1;
+            return;
         }
+
+        auto* hdr = as_ptr<block_header>(buffer) - 1;
+        malloced_bytes -= block_size(hdr);
+        release(hdr);
     }
 } // namespace alloc
-
@@ -0,0 +1,177 @@
+#include <acpi/acpi.h>
+#include <kinit/boot_resource.h>
+#include <misc/cast.h>
+#include <mm/mm.h>
+#include <mm/numa.h>
+
+namespace mm
+{
+    namespace
+    {
+        struct memory_affinity
+        {
+            std::uintptr_t start;
+            std::uintptr_t end;
+            std::size_t node;
+        };
+
+        struct processor_affinity
+        {
+            std::uint32_t apic_id;
+            std::size_t node;
+        };
+
+        inline constexpr std::size_t MAX_MEMORY_AFFINITIES = 64;
+        inline constexpr std::size_t MAX_PROCESSOR_AFFINITIES = 256;
+
+        memory_affinity memory_affinities[MAX_MEMORY_AFFINITIES];
+        std::size_t memory_affinity_count = 0;
+        processor_affinity processor_affinities[MAX_PROCESSOR_AFFINITIES];
+        std::size_t processor_affinity_count = 0;
+
+        // proximity domains in the order they were first seen, a domain's index is its node
+        std::uint32_t domains[MAX_NUMA_NODES];
+        std::size_t domain_count = 0;
+
+        auto node_of_domain(std::uint32_t domain) -> std::size_t
+        {
+            for (std::size_t i = 0; i < domain_count; i++)
+            {
+                if (domains[i] == domain)
+                {
+                    return i;
+                }
+            }
+
+            if (domain_count == MAX_NUMA_NODES)
+            {
+                return 0;
+            }
+
+            domains[domain_count] = domain;
+            return domain_count++;
+        }
+
+        auto find_srat() -> const acpi::srat*
+        {
+            const acpi::srat* table = nullptr;
+            boot_resource::instance().iterate_xsdt([&](const acpi::acpi_sdt_header* entry) {
+                auto* header = make_virtual<const acpi::acpi_sdt_header>(as_uptr(entry));
+                if (header->signature == acpi::srat::SIGNATURE)
+                {
+                    table = cast_ptr<const acpi::srat>(header);
+                }
+            });
+
+            return table;
+        }
+
+        void add_processor(std::uint32_t apic_id, std::uint32_t domain)
+        {
+            if (processor_affinity_count < MAX_PROCESSOR_AFFINITIES)
+            {
+                processor_affinities[processor_affinity_count++] = {apic_id, node_of_domain(domain)};
+            }
+        }
+    } // namespace
+
+    void numa_init()
+    {
+        const auto* table = find_srat();
+        if (table == nullptr)
+        {
+            return;
+        }
+
+        std::uintptr_t base = as_uptr(table);
+        std::size_t offset = sizeof(acpi::srat);
+        while (offset + sizeof(acpi::srat_entry_descriptor) <= table->parent.length)
+        {
+            const auto* desc = as_ptr<const acpi::srat_entry_descriptor>(base + offset);
+            std::uintptr_t body = base + offset + sizeof(acpi::srat_entry_descriptor);
+            if (desc->length < sizeof(acpi::srat_entry_descriptor))
+            {
+                break;
+            }
+
+            switch (desc->type)
+            {
+            case acpi::srat_processor_affinity::SIGNATURE: {
+                const auto* entry = as_ptr<const acpi::srat_processor_affinity>(body);
+                if (entry->flags & acpi::srat_processor_affinity::FLAG_ENABLED)
+                {
+                    std::uint32_t domain = entry->proximity_domain_low | (entry->proximity_domain_high[0] << 8) |
+                                           (entry->proximity_domain_high[1] << 16) | (entry->proximity_domain_high[2] << 24);
+                    add_processor(entry->apic_id, domain);
+                }
+                break;
+            }
+            case acpi::srat_memory_affinity::SIGNATURE: {
+                const auto* entry = as_ptr<const acpi::srat_memory_affinity>(body);
+                if ((entry->flags & acpi::srat_memory_affinity::FLAG_ENABLED) && entry->length != 0 &&
+                    memory_affinity_count < MAX_MEMORY_AFFINITIES)
+                {
+                    memory_affinities[memory_affinity_count++] = {entry->base, entry->base + entry->length, node_of_domain(entry->proximity_domain)};
+                }
+                break;
+            }
+            case acpi::srat_processor_x2apic_affinity::SIGNATURE: {
+                const auto* entry = as_ptr<const acpi::srat_processor_x2apic_affinity>(body);
+                if (entry->flags & acpi::srat_processor_x2apic_affinity::FLAG_ENABLED)
+                {
+                    add_processor(entry->x2apic_id, entry->proximity_domain);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+
+            offset += desc->length;
+        }
+    }
+
+    auto numa_node_count() -> std::size_t { return domain_count != 0 ? domain_count : 1; }
+
+    auto numa_node_of(std::uintptr_t addr, std::uintptr_t* end) -> std::size_t
+    {
+        // memory the SRAT says nothing about goes to node 0, up to the next range it does describe
+        std::size_t node = 0;
+        std::uintptr_t limit = ~0UL;
+        for (std::size_t i = 0; i < memory_affinity_count; i++)
+        {
+            const auto& range = memory_affinities[i];
+            if (addr >= range.start && addr < range.end)
+            {
+                node = range.node;
+                limit = range.end;
+                break;
+            }
+
+            if (range.start > addr && range.start < limit)
+            {
+                limit = range.start;
+            }
+        }
+
+        if (end != nullptr)
+        {
+            *end = limit;
+        }
+
+        return node;
+    }
+
+    auto numa_node_of_apic(std::uint32_t apic_id) -> std::size_t
+    {
+        for (std::size_t i = 0; i < processor_affinity_count; i++)
+        {
+            if (processor_affinities[i].apic_id == apic_id)
+            {
+                return processor_affinities[i].node;
+            }
+        }
+
+        return 0;
+    }
+} // namespace mm
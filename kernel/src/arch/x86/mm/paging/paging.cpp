@@ -1,4 +1,5 @@
 #include <asm/asm_cpp.h>
+#include <atomic>
 #include <bits/utils.h>
 #include <cstring>
 #include <debug/debug.h>
@@ -8,15 +9,13 @@
 #include <mm/mm.h>
 #include <mm/paging/paging.h>
 #include <mm/paging/paging_entries.h>
+#include <mm/paging/tlb.h>
 #include <smp/smp.h>
-#include <sync/spinlock.h>
 
 #define GET_VIRTUAL_POS(n) get_bits<(4 - n) * 9 + 12, (4 - n) * 9 + 20>(VIRT_LOAD_POSITION)
 
 namespace paging
 {
-    void install() { write_cr3(mm::make_physical(smp::core_local::get().pagemap)); }
-
     static inline constexpr std::uint64_t type_to_align[] = {
         0xfff,
         0x1fffff,
@@ -25,22 +24,38 @@ namespace paging
 
     namespace
     {
-        lock::spinlock paging_global_lock;
+        page_table_entry* kernel_pagemap = nullptr;
+
+        // installs value into an empty entry, fails if another core got there first
+        auto install_entry(page_table_entry& entry, std::uint64_t value) -> bool
+        {
+            std::uint64_t expected = 0;
+            return std::direct_atomic_compare_exchange_n(&entry, &expected, value, false, std::memory_order_acq_rel, std::memory_order_acquire);
+        }
+    } // namespace
+
+    auto kernel_table() -> page_table_entry* { return kernel_pagemap; }
+
+    void init_kernel_table()
+    {
+        kernel_pagemap = as_ptr(expect_nonnull(mm::pmm_stupid_allocate(), "cannot allocate the kernel page tables"));
+        std::memset(kernel_pagemap, 0, PAGE_SMALL_SIZE);
     }
 
+    void install() { write_cr3(mm::make_physical(kernel_pagemap)); }
+
+    // walks down to the entry mapping virtual_addr at the level of type, creating any missing table with Fn
+    // there is no lock: missing tables are installed with a CAS, and tables are only ever freed together with their address space
     template <void* (*Fn)()>
-    auto do_map_page_for(page_table_entry* table, page_type type, std::uintptr_t virtual_addr, std::uintptr_t physical_addr, page_prop prop,
-                         bool overwrite) -> bool
+    auto walk_or_create(page_table_entry* table, page_type type, std::uintptr_t virtual_addr) -> page_table_entry*
     {
-        virtual_addr &= ~type_to_align[type];
-        physical_addr &= ~type_to_align[type];
-
         page_table_entry* current_entry = table;
         for (int i = 0; i < (3 - type); i++)
         {
             auto index = get_page_entry(virtual_addr, i);
             std::uint64_t& entry = current_entry[index];
-            if (!entry)
+            std::uint64_t value = std::direct_atomic_load_n(&entry, std::memory_order_acquire);
+            if (!value)
             {
                 auto* mem = Fn();
                 if (mem == nullptr)
@@ -49,85 +64,214 @@ namespace paging
                 }
 
                 std::memset(mem, 0, PAGE_SMALL_SIZE);
-                entry = make_page_pointer(mm::make_physical(mem), {
+                value = make_page_pointer(mm::make_physical(mem), {
                                                                       .rw = true, // since x86 ands all permission bits, we want this to be true!
                                                                       .us = true,
                                                                       .x = true,
                                                                   });
+
+                if (!install_entry(entry, value))
+                {
+                    // another core installed a table first, use theirs
+                    // the early allocator cannot free, but it only runs before the other cores are up
+                    if constexpr (Fn != mm::pmm_stupid_allocate)
+                    {
+                        mm::pmm_free(mem);
+                    }
+
+                    value = std::direct_atomic_load_n(&entry, std::memory_order_acquire);
+                }
+                else if (smp::core_local::exists())
+                {
+                    mm::stat_add(smp::core_local::get().mem_stats.page_tables_allocated);
+                }
             }
 
-            current_entry = mm::make_virtual<page_table_entry>(current_entry[index] & MASK_TABLE_POINTER);
-        }
-        // write last entry
-        current_entry += get_page_entry(virtual_addr, 3 - type);
-        if (*current_entry && !overwrite)
-        {
-            return false;
+            current_entry = mm::make_virtual<page_table_entry>(value & MASK_TABLE_POINTER);
         }
+
+        return current_entry + get_page_entry(virtual_addr, 3 - type);
+    }
+
+    template <void* (*Fn)()>
+    auto do_map_page_for(page_table_entry* table, page_type type, std::uintptr_t virtual_addr, std::uintptr_t physical_addr, page_prop prop,
+                         bool overwrite, std::uint64_t extra_flags) -> bool
+    {
+        virtual_addr &= ~type_to_align[type];
+        physical_addr &= ~type_to_align[type];
+
+        std::uint64_t value = 0;
         switch (type)
         {
         case SMALL:
-            *current_entry = make_page_small(physical_addr, prop);
+            value = make_page_small(physical_addr, prop);
             break;
         case MEDIUM:
-            *current_entry = make_page_medium(physical_addr, prop);
+            value = make_page_medium(physical_addr, prop);
             break;
         case BIG:
-            *current_entry = make_page_large(physical_addr, prop);
+            value = make_page_large(physical_addr, prop);
             break;
         }
+        value |= extra_flags;
 
-        return true;
+        // write last entry
+        page_table_entry* current_entry = walk_or_create<Fn>(table, type, virtual_addr);
+        if (overwrite)
+        {
+            std::direct_atomic_store_n(current_entry, value, std::memory_order_release);
+            return true;
+        }
+
+        return install_entry(*current_entry, value);
     }
 
     auto map_page_for(page_table_entry* table, page_type type, std::uintptr_t virtual_addr, std::uintptr_t physical_addr, page_prop prop,
-                      bool overwrite) -> bool
+                      bool overwrite, std::uint64_t extra_flags) -> bool
     {
-        return do_map_page_for<+[]() { return mm::pmm_allocate(); }>(table, type, virtual_addr, physical_addr, prop, overwrite);
+        return do_map_page_for<+[]() { return mm::pmm_allocate(); }>(table, type, virtual_addr, physical_addr, prop, overwrite, extra_flags);
     }
 
     auto map_page_for_early(page_table_entry* table, page_type type, std::uintptr_t virtual_addr, std::uintptr_t physical_addr, page_prop prop,
                             bool overwrite) -> bool
     {
-        return do_map_page_for<mm::pmm_stupid_allocate>(table, type, virtual_addr, physical_addr, prop, overwrite);
+        return do_map_page_for<mm::pmm_stupid_allocate>(table, type, virtual_addr, physical_addr, prop, overwrite, 0);
     }
 
     auto request_page(page_type type, std::uintptr_t vaddr, std::uintptr_t paddr, page_prop prop, bool overwrite) -> bool
     {
-        lock::spinlock_guard guard(paging_global_lock);
-        // obtain pointer to entry
-        page_table_entry* current_entry = smp::core_local::get().pagemap;
-        if (current_entry == nullptr)
+        return map_page_for(kernel_pagemap, type, vaddr, paddr, prop, overwrite);
+    }
+
+    auto request_page_early(page_type type, std::uint64_t vaddr, std::uint64_t paddr, page_prop prop, bool overwrite) -> bool
+    {
+        return map_page_for_early(kernel_pagemap, type, vaddr, paddr, prop, overwrite);
+    }
+
+    auto reserve_page_for(page_table_entry* table, std::uintptr_t virtual_addr, page_prop prop) -> bool
+    {
+        page_table_entry* entry = walk_or_create<+[]() { return mm::pmm_allocate(); }>(table, SMALL, virtual_addr);
+        return install_entry(*entry, make_page_demand(prop));
+    }
+
+    auto reserve_page(std::uintptr_t vaddr, page_prop prop) -> bool
+    {
+        return reserve_page_for(kernel_pagemap, vaddr, prop);
+    }
+
+    auto leaf_table_for(page_table_entry* table, std::uintptr_t virtual_addr, bool early) -> page_table_entry*
+    {
+        page_table_entry* entry = early ? walk_or_create<mm::pmm_stupid_allocate>(table, SMALL, virtual_addr)
+                                        : walk_or_create<+[]() { return mm::pmm_allocate(); }>(table, SMALL, virtual_addr);
+        return entry - get_page_entry(virtual_addr, 3);
+    }
+
+    void install_leaf(page_table_entry& entry, std::uint64_t value, bool overwrite)
+    {
+        if (overwrite)
         {
-            current_entry = smp::core_local::get().pagemap = as_ptr(mm::pmm_allocate());
+            std::direct_atomic_store_n(&entry, value, std::memory_order_release);
+            return;
         }
 
-        return map_page_for(current_entry, type, vaddr, paddr, prop, overwrite);
+        expect(install_entry(entry, value), "map_range: page is already mapped");
     }
 
-    auto request_page_early(page_type type, std::uint64_t vaddr, std::uint64_t paddr, page_prop prop, bool overwrite) -> bool
+    auto find_leaf_table(page_table_entry* table, std::uintptr_t virtual_addr) -> page_table_entry*
+    {
+        auto* entry = lookup_entry(table, virtual_addr);
+        return entry == nullptr ? nullptr : entry - get_page_entry(virtual_addr, 3);
+    }
+
+    auto lookup_entry(page_table_entry* table, std::uintptr_t virtual_addr) -> page_table_entry*
     {
-        lock::spinlock_guard guard(paging_global_lock);
-        // obtain pointer to entry
-        page_table_entry* current_entry = smp::core_local::get().pagemap;
-        if (current_entry == nullptr)
+        page_table_entry* current_entry = table;
+        for (int i = 0; i < 3; i++)
         {
-            current_entry = smp::core_local::get().pagemap = as_ptr(mm::pmm_stupid_allocate());
+            auto entry = current_entry[get_page_entry(virtual_addr, i)];
+            if (!(entry & PRESENT) || (entry & PAGE_SIZE))
+            {
+                return nullptr;
+            }
+
+            current_entry = mm::make_virtual<page_table_entry>(entry & MASK_TABLE_POINTER);
+        }
+
+        return current_entry + get_page_entry(virtual_addr, 3);
+    }
+
+    auto translate(const page_table_entry* table, std::uintptr_t virtual_addr) -> std::uintptr_t
+    {
+        static constexpr std::uint64_t type_to_mask[] = {MASK_TABLE_SMALL, MASK_TABLE_MEDIUM, MASK_TABLE_LARGE};
+
+        const page_table_entry* current_entry = table;
+        for (int i = 0; i < 4; i++)
+        {
+            auto entry = current_entry[get_page_entry(virtual_addr, i)];
+            if (!(entry & PRESENT))
+            {
+                return 0;
+            }
+
+            // bit 7 is PAT rather than the page size in the last level
+            if (i == 3 || (i > 0 && (entry & PAGE_SIZE)))
+            {
+                auto type = 3 - i;
+                return (entry & type_to_mask[type]) | (virtual_addr & type_to_align[type]);
+            }
+
+            current_entry = mm::make_virtual<page_table_entry>(entry & MASK_TABLE_POINTER);
         }
 
-        return map_page_for_early(current_entry, type, vaddr, paddr, prop, overwrite);
+        return 0;
     }
 
-    void sync(std::uintptr_t virtual_addr)
+    auto unmap_page_for(page_table_entry* table, std::uintptr_t virtual_addr, page_type* type) -> std::uintptr_t
     {
-        lock::spinlock_guard guard(paging_global_lock);
-        std::uint16_t index = paging::get_page_entry<3>(virtual_addr);
-        std::uint64_t value = smp::core_local::get().pagemap[index];
+        page_table_entry* current_entry = table;
+        for (int i = 0; i < 3; i++)
+        {
+            auto& entry = current_entry[get_page_entry(virtual_addr, i)];
+            if (!(entry & PRESENT))
+            {
+                return 0;
+            }
+
+            if (entry & PAGE_SIZE)
+            {
+                expect(i == 2 && (virtual_addr & type_to_align[MEDIUM]) == 0, "cannot unmap part of a large page");
+                std::uintptr_t physical_addr = std::direct_atomic_exchange_n(&entry, std::uint64_t{0}, std::memory_order_acq_rel) & MASK_TABLE_MEDIUM;
+                if (type != nullptr)
+                {
+                    *type = MEDIUM;
+                }
 
-        for (std::size_t i = 0; i < boot_resource::instance().core_count(); i++)
+                return physical_addr;
+            }
+
+            current_entry = mm::make_virtual<page_table_entry>(entry & MASK_TABLE_POINTER);
+        }
+
+        // whoever swaps the entry out owns the page, so two cores unmapping the same page cannot both free it
+        auto value = std::direct_atomic_exchange_n(&current_entry[get_page_entry(virtual_addr, 3)], std::uint64_t{0}, std::memory_order_acq_rel);
+        std::uintptr_t physical_addr = (value & PRESENT) ? value & MASK_TABLE_SMALL : 0;
+        if (type != nullptr)
         {
-            smp::core_local::get(i).pagemap[index] = value;
+            *type = SMALL;
         }
+
+        return physical_addr;
+    }
+
+    auto unmap_page(std::uintptr_t vaddr, page_type* type) -> std::uintptr_t
+    {
+        return unmap_page_for(kernel_pagemap, vaddr, type);
+    }
+
+    void flush_tlb_range(std::uintptr_t vaddr, std::size_t pages)
+    {
+        tlb_batch batch;
+        batch.add(vaddr, pages);
     }
 
     template <decltype(map_hhdm_page) Fn>
@@ -188,11 +332,6 @@ namespace paging
         return do_map_hhdm_section<map_hhdm_page_early>(addr, len, prop, overwrite);
     }
 
-    void sync_page_tables(std::size_t dest_core, std::size_t src_core)
-    {
-        copy_kernel_page_tables(smp::core_local::get(dest_core).pagemap, smp::core_local::get(src_core).pagemap);
-    }
-
     void copy_kernel_page_tables(page_table_entry* dest, const page_table_entry* src)
     {
         std::memcpy(dest + 256, src + 256, 256 * sizeof(paging::page_table_entry));
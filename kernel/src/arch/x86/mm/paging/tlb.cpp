@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <asm/asm_cpp.h>
+#include <atomic>
+#include <cpuid/cpuid.h>
+#include <idt/idt.h>
+#include <kinit/boot_resource.h>
+#include <misc/kassert.h>
+#include <mm/paging/paging.h>
+#include <mm/paging/tlb.h>
+#include <smp/smp.h>
+
+namespace paging
+{
+    namespace
+    {
+        inline constexpr std::uint64_t INVPCID_ADDRESS = 0;
+        inline constexpr std::uint64_t INVPCID_ALL = 2;
+
+        bool has_invpcid = false;
+
+        void invalidate_current(const tlb_range* ranges, std::size_t count, bool flush_all)
+        {
+            if (flush_all)
+            {
+                write_cr3(read_cr3());
+                return;
+            }
+
+            for (std::size_t i = 0; i < count; i++)
+            {
+                for (std::size_t j = 0; j < ranges[i].pages; j++)
+                {
+                    invlpg(ranges[i].start + j * PAGE_SMALL_SIZE);
+                }
+            }
+        }
+
+        // invlpg and cr3 reloads only reach the active PCID, the others need invpcid or a flush the next time they are loaded
+        void flush_local(const tlb_range* ranges, std::size_t count, bool flush_all)
+        {
+            // a context switch in between would change the active PCID under us
+            lock::interrupt_save_guard irq;
+            if (!smp::core_local::exists() || !smp::core_local::get().pcids.enabled)
+            {
+                invalidate_current(ranges, count, flush_all);
+                return;
+            }
+
+            auto& pcids = smp::core_local::get().pcids;
+            std::uint64_t current = read_cr3() & MASK_CR3_PCID;
+
+            if (!has_invpcid)
+            {
+                invalidate_current(ranges, count, flush_all);
+                pcids.stale = ((1U << PCID_SLOTS) - 1) & ~(current != 0 ? 1U << (current - 1) : 0);
+                return;
+            }
+
+            if (flush_all)
+            {
+                invpcid(INVPCID_ALL, 0, 0);
+                pcids.stale = 0;
+                return;
+            }
+
+            invalidate_current(ranges, count, false);
+            for (std::size_t slot = 0; slot < PCID_SLOTS; slot++)
+            {
+                if (slot + 1 == current || std::direct_atomic_load_n(&pcids.tables[slot], std::memory_order_relaxed) == 0)
+                {
+                    continue;
+                }
+
+                for (std::size_t i = 0; i < count; i++)
+                {
+                    for (std::size_t j = 0; j < ranges[i].pages; j++)
+                    {
+                        invpcid(INVPCID_ADDRESS, slot + 1, ranges[i].start + j * PAGE_SMALL_SIZE);
+                    }
+                }
+            }
+        }
+
+        // performs everything other cores have queued for this one
+        void drain(tlb_queue& queue)
+        {
+            lock::interrupt_save_guard irq;
+            tlb_range ranges[TLB_QUEUE_SIZE];
+            std::size_t count = 0;
+            bool flush_all = false;
+            std::uint64_t ticket = 0;
+
+            {
+                lock::spinlock_guard guard(queue.lock);
+                count = queue.count;
+                flush_all = queue.flush_all;
+                ticket = queue.requested;
+                std::copy(queue.ranges, queue.ranges + count, ranges);
+                queue.count = 0;
+                queue.flush_all = false;
+            }
+
+            flush_local(ranges, count, flush_all);
+            std::direct_atomic_store_n(&queue.completed, ticket, std::memory_order_release);
+        }
+
+        void handle_shootdown(std::uint64_t /*unused*/, std::uint64_t /*unused*/)
+        {
+            auto& local = smp::core_local::get();
+            drain(local.tlb_queue);
+            local.apic.end();
+        }
+
+        // queues the batch on target, returns whether it needs an IPI to pick it up
+        auto enqueue(tlb_queue& target, const tlb_range* ranges, std::size_t count, bool flush_all) -> bool
+        {
+            lock::interrupt_save_guard irq;
+            lock::spinlock_guard guard(target.lock);
+
+            // if something is pending the IPI for it is still in flight, and will pick this batch up as well
+            bool idle = target.count == 0 && !target.flush_all;
+
+            if (flush_all || target.count + count > TLB_QUEUE_SIZE)
+            {
+                target.flush_all = true;
+            }
+            else
+            {
+                std::copy(ranges, ranges + count, target.ranges + target.count);
+                target.count += count;
+            }
+
+            target.requested++;
+            return idle;
+        }
+    } // namespace
+
+    void invalidate_local(const tlb_range& range) { flush_local(&range, 1, range.pages > INVLPG_MAX_PAGES); }
+
+    void tlb_batch::add(std::uintptr_t vaddr, std::size_t pages)
+    {
+        if (flush_all)
+        {
+            return;
+        }
+
+        if (pages > INVLPG_MAX_PAGES || count == TLB_QUEUE_SIZE)
+        {
+            flush_all = true;
+            return;
+        }
+
+        ranges[count++] = {vaddr, pages};
+    }
+
+    void tlb_batch::flush()
+    {
+        if (count == 0 && !flush_all)
+        {
+            return;
+        }
+
+        flush_local(ranges, count, flush_all);
+
+        // until this core takes part in shootdowns, there is nobody it could send one to either
+        if (smp::core_local::exists() && std::direct_atomic_load_n(&smp::core_local::get().tlb_queue.online, std::memory_order_acquire))
+        {
+            auto& self = smp::core_local::get();
+            std::size_t cores = boot_resource::instance().core_count();
+
+            for (std::size_t i = 0; i < cores; i++)
+            {
+                auto& target = smp::core_local::get(i);
+                if (&target == &self || !std::direct_atomic_load_n(&target.tlb_queue.online, std::memory_order_acquire))
+                {
+                    continue;
+                }
+
+                if (enqueue(target.tlb_queue, ranges, count, flush_all))
+                {
+                    self.apic.send_ipi(target.apic_id, TLB_SHOOTDOWN_VECTOR);
+                }
+            }
+
+            for (std::size_t i = 0; i < cores; i++)
+            {
+                auto& target = smp::core_local::get(i);
+                if (&target == &self || !std::direct_atomic_load_n(&target.tlb_queue.online, std::memory_order_acquire))
+                {
+                    continue;
+                }
+
+                // any ticket handed out by now is at least ours
+                std::uint64_t ticket = std::direct_atomic_load_n(&target.tlb_queue.requested, std::memory_order_acquire);
+                while (std::direct_atomic_load_n(&target.tlb_queue.completed, std::memory_order_acquire) < ticket)
+                {
+                    // the target may just as well be waiting on us
+                    drain(self.tlb_queue);
+                    pause();
+                }
+            }
+        }
+
+        count = 0;
+        flush_all = false;
+    }
+
+    void init_tlb_shootdown()
+    {
+        auto& local = smp::core_local::get();
+        expect(idt::register_idt(idt::idt_builder(handle_shootdown).ist(1), TLB_SHOOTDOWN_VECTOR), "failed to allocate irq for tlb shootdowns");
+        std::direct_atomic_store_n(&local.tlb_queue.online, true, std::memory_order_release);
+    }
+
+    void init_pcid()
+    {
+        if (!cpuid_info::test_feature(cpuid_info::FEATURE_PCID))
+        {
+            return;
+        }
+
+        has_invpcid = cpuid_info::test_feature(cpuid_info::FEATURE_INVPCID);
+        write_cr4(read_cr4() | CR4_PCIDE);
+        smp::core_local::get().pcids.enabled = true;
+    }
+
+    void switch_table(std::uintptr_t physical_addr)
+    {
+        std::uint64_t current = read_cr3();
+        if ((current & MASK_TABLE_POINTER) == physical_addr)
+        {
+            return;
+        }
+
+        auto& pcids = smp::core_local::get().pcids;
+        if (!pcids.enabled)
+        {
+            write_cr3(physical_addr);
+            return;
+        }
+
+        std::size_t slot = 0;
+        while (slot < PCID_SLOTS && std::direct_atomic_load_n(&pcids.tables[slot], std::memory_order_relaxed) != physical_addr)
+        {
+            slot++;
+        }
+
+        // anything left over in the PCID of a recycled or stale slot has to go
+        bool flush = false;
+        if (slot == PCID_SLOTS)
+        {
+            slot = pcids.next;
+            pcids.next = (pcids.next + 1) % PCID_SLOTS;
+            std::direct_atomic_store_n(&pcids.tables[slot], physical_addr, std::memory_order_relaxed);
+            flush = true;
+        }
+        else if ((pcids.stale & (1U << slot)) != 0)
+        {
+            flush = true;
+        }
+
+        pcids.stale &= ~(1U << slot);
+        write_cr3(physical_addr | (slot + 1) | (flush ? 0 : CR3_NO_FLUSH));
+    }
+
+    void release_pcid(std::uintptr_t physical_addr)
+    {
+        for (std::size_t i = 0; i < boot_resource::instance().core_count(); i++)
+        {
+            auto& pcids = smp::core_local::get(i).pcids;
+            for (auto& table : pcids.tables)
+            {
+                std::uintptr_t expected = physical_addr;
+                std::direct_atomic_compare_exchange_n(&table, &expected, std::uintptr_t{0}, false, std::memory_order_relaxed,
+                                                      std::memory_order_relaxed);
+            }
+        }
+    }
+} // namespace paging
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <atomic>
 #include <config.h>
 #include <cstdint>
 #include <intrusive_list.h>
@@ -5,41 +7,443 @@
 #include <klog/klog.h>
 #include <misc/kassert.h>
 #include <mm/mm.h>
+#include <mm/numa.h>
 #include <mm/paging/paging.h>
+#include <smp/smp.h>
 #include <sync/spinlock.h>
 #include <utils/id_allocator.h>
 
 namespace mm
 {
-    static std::intrusive_list<page_info> free_list;
-    static lock::spinlock pmm_alloc_lock;
+    namespace
+    {
+        // a physically contiguous range of pages handed to the pmm, in page indices
+        // blocks never cross the boundaries of a region, since the PFN entries outside of it may not be mapped
+        // regions never span NUMA nodes either, so every block belongs to exactly one zone
+        struct pmm_region
+        {
+            std::size_t start;
+            std::size_t end;
+            std::size_t node;
+        };
+
+        // the part of a region whose PFN entries are set up after boot
+        struct deferred_range
+        {
+            std::size_t start;
+            std::size_t end;
+            std::size_t region;
+        };
+
+        // the free blocks of one NUMA node
+        struct zone
+        {
+            std::intrusive_list<page_info> free_lists[PMM_MAX_ORDER + 1];
+            lock::spinlock lock;
+        };
+
+        // as many as page_info can tell apart
+        inline constexpr std::size_t MAX_REGIONS = 256;
+        // deferred memory is set up in naturally aligned chunks of the largest order, buddies never cross a chunk boundary
+        inline constexpr std::size_t DEFERRED_CHUNK_PAGES = 1UL << PMM_MAX_ORDER;
+
+        zone zones[MAX_NUMA_NODES];
+        pmm_region regions[MAX_REGIONS];
+        std::size_t region_count = 0;
+
+        deferred_range deferred[MAX_REGIONS];
+        std::size_t deferred_count = 0;
+        std::size_t early_pages_left = config::get_val<"pmm.early-pages">;
+        // the next chunk to hand to a core in pmm_init_deferred()
+        std::size_t next_chunk = 0;
+
+        // the pmm only runs once _start has pointed gs at cpu0's core_local, which is long before core_local::create() makes
+        // exists() true, so the early allocations already see cpu0's node and are counted on cpu0 as well
+        auto local_node() -> std::size_t
+        {
+            auto* local = smp::core_local::get_pointer();
+            return local != nullptr ? local->numa_node : 0;
+        }
+
+        void count(std::uint64_t mem_stats::*counter, std::uint64_t n)
+        {
+            if (auto* local = smp::core_local::get_pointer(); local != nullptr)
+            {
+                stat_add(local->mem_stats.*counter, n);
+            }
+        }
+
+        // marks the core as inside the pmm for the page fault handler, only ever made with interrupts off
+        class pmm_section
+        {
+            smp::core_local* local = smp::core_local::get_pointer();
+            bool outer = local != nullptr && local->in_pmm;
+
+        public:
+            pmm_section()
+            {
+                if (local != nullptr)
+                {
+                    local->in_pmm = true;
+                }
+            }
+
+            ~pmm_section()
+            {
+                if (local != nullptr)
+                {
+                    local->in_pmm = outer;
+                }
+            }
+
+            pmm_section(const pmm_section&) = delete;
+            pmm_section(pmm_section&&) = delete;
+            auto operator=(const pmm_section&) -> pmm_section& = delete;
+            auto operator=(pmm_section&&) -> pmm_section& = delete;
+        };
+
+        auto zone_of(std::size_t index) -> zone& { return zones[regions[index_to_pfn(index).get_region()].node]; }
+
+        void push_block(zone& zone, page_info& head, std::size_t order)
+        {
+            head.set_type(page_info::FREE);
+            head.set_order(order);
+            zone.free_lists[order].add_front(&head);
+        }
+
+        void unlink_block(zone& zone, page_info& head, std::size_t order)
+        {
+            zone.free_lists[order].remove(&head);
+            // the page is no longer the head of a free block
+            head.set_type(page_info::USED);
+        }
+
+        // the following routines expect the lock of the zone to be held
+        auto buddy_allocate(zone& zone, std::size_t order) -> page_info*
+        {
+            std::size_t current = order;
+            while (current <= PMM_MAX_ORDER && zone.free_lists[current].get_front() == nullptr)
+            {
+                current++;
+            }
+
+            if (current > PMM_MAX_ORDER)
+            {
+                return nullptr;
+            }
+
+            auto* head = zone.free_lists[current].get_front();
+            unlink_block(zone, *head, current);
+
+            // split off the upper halves until the block is of the requested size
+            std::size_t index = pfn_to_index(*head);
+            while (current > order)
+            {
+                current--;
+                push_block(zone, index_to_pfn(index + (1UL << current)), current);
+            }
+
+            head->set_order(order);
+            return head;
+        }
+
+        void buddy_free(zone& zone, std::size_t index, std::size_t order)
+        {
+            const auto& region = regions[index_to_pfn(index).get_region()];
+
+            while (order < PMM_MAX_ORDER)
+            {
+                std::size_t buddy_index = index ^ (1UL << order);
+                if (buddy_index < region.start || buddy_index + (1UL << order) > region.end)
+                {
+                    break;
+                }
+
+                auto& buddy = index_to_pfn(buddy_index);
+                if (buddy.get_type() != page_info::FREE || buddy.get_order() != order)
+                {
+                    break;
+                }
+
+                unlink_block(zone, buddy, order);
+                index &= ~(1UL << order);
+                order++;
+            }
+
+            push_block(zone, index_to_pfn(index), order);
+        }
+
+        // takes a block from the local node if it has one, and from the other nodes in turn otherwise
+        auto allocate_block(std::size_t order) -> page_info*
+        {
+            std::size_t local = local_node();
+            for (std::size_t i = 0; i < numa_node_count(); i++)
+            {
+                auto& zone = zones[(local + i) % numa_node_count()];
+                lock::spinlock_guard guard(zone.lock);
+                if (auto* head = buddy_allocate(zone, order))
+                {
+                    return head;
+                }
+            }
+
+            return nullptr;
+        }
+
+        // pages stay marked as used while they sit in a cache, so the buddy allocator never merges with them
+        void refill_cache(page_cache& cache)
+        {
+            std::size_t local = local_node();
+            for (std::size_t i = 0; i < numa_node_count() && cache.count < config::get_val<"pmm.cache.low">; i++)
+            {
+                auto& zone = zones[(local + i) % numa_node_count()];
+                lock::spinlock_guard guard(zone.lock);
+                while (cache.count < config::get_val<"pmm.cache.low">)
+                {
+                    auto* page = buddy_allocate(zone, 0);
+                    if (page == nullptr)
+                    {
+                        break;
+                    }
+
+                    cache.pages[cache.count++] = mm::make_virtual<void>(pfn_to_page(*page));
+                }
+            }
+        }
+
+        void drain_cache(page_cache& cache)
+        {
+            // the bottom of the stack has been sitting around the longest, so hand those pages back first
+            std::size_t drain_count = cache.count - config::get_val<"pmm.cache.low">;
+
+            auto index_of = [&](std::size_t i) { return make_physical(cache.pages[i]) / paging::PAGE_SMALL_SIZE; };
+
+            // one lock per zone, the pages of a cache almost always come from the same one
+            for (std::size_t node = 0; node < numa_node_count(); node++)
+            {
+                auto& zone = zones[node];
+                std::size_t first = 0;
+                while (first < drain_count && &zone_of(index_of(first)) != &zone)
+                {
+                    first++;
+                }
 
-    void pmm_add_region(std::uintptr_t /*unused*/, std::size_t /*unused*/) { expect(false, "not implemented"); }
+                if (first == drain_count)
+                {
+                    continue;
+                }
 
-    // TODO: figure out sync
-    auto pmm_allocate() -> void*
+                lock::spinlock_guard guard(zone.lock);
+                for (std::size_t i = first; i < drain_count; i++)
+                {
+                    if (std::size_t index = index_of(i); &zone_of(index) == &zone)
+                    {
+                        buddy_free(zone, index, 0);
+                    }
+                }
+            }
+
+            std::memmove(cache.pages, cache.pages + drain_count, (cache.count - drain_count) * sizeof(void*));
+            cache.count -= drain_count;
+        }
+
+        // sets up the PFN entries of [start, end) and gives the pages to the buddy allocator
+        // only the free lists are shared, so cores can do this for different chunks at the same time
+        void init_pages(std::size_t start, std::size_t end, std::size_t region)
+        {
+            for (std::size_t i = start; i < end; i++)
+            {
+                auto& info = *new (&index_to_pfn(i)) page_info();
+                info.set_type(page_info::USED);
+                info.set_region(region);
+            }
+
+            auto& zone = zones[regions[region].node];
+            lock::interrupt_save_guard int_guard;
+            pmm_section section;
+            lock::spinlock_guard guard(zone.lock);
+
+            // carve the range into the largest naturally aligned blocks that fit
+            std::size_t index = start;
+            while (index < end)
+            {
+                std::size_t order = PMM_MAX_ORDER;
+                while (order > 0 && ((index & ((1UL << order) - 1)) != 0 || index + (1UL << order) > end))
+                {
+                    order--;
+                }
+
+                push_block(zone, index_to_pfn(index), order);
+                index += 1UL << order;
+            }
+        }
+
+        auto add_region(std::size_t start, std::size_t end, std::size_t node) -> std::size_t
+        {
+            expect(region_count < MAX_REGIONS, "pmm: too many memory regions");
+            regions[region_count] = {start, end, node};
+            return region_count++;
+        }
+
+        auto chunks_of(const deferred_range& range) -> std::size_t
+        {
+            return std::div_roundup(range.end, DEFERRED_CHUNK_PAGES) - range.start / DEFERRED_CHUNK_PAGES;
+        }
+
+        void add_node_region(std::uintptr_t base, std::uintptr_t limit, std::size_t node)
+        {
+            std::size_t start = std::div_roundup(base, paging::PAGE_SMALL_SIZE);
+            std::size_t end = limit / paging::PAGE_SMALL_SIZE;
+
+            if (start >= end)
+            {
+                return;
+            }
+
+            // this runs on the bootstrap core before anything else could allocate
+            expect(pfn_valid(start) && pfn_valid(end - 1), "pmm: region outside of the PFN sections");
+
+            // what boot needs is set up right away, rounded up to a 2 MiB boundary so that large pages can still come from it
+            std::size_t split = start;
+            if (early_pages_left != 0)
+            {
+                constexpr std::size_t SPLIT_PAGES = 1UL << PMM_MEDIUM_ORDER;
+                split = std::min(end, std::div_roundup(start + early_pages_left, SPLIT_PAGES) * SPLIT_PAGES);
+                early_pages_left -= std::min(early_pages_left, split - start);
+            }
+
+            if (split != start)
+            {
+                std::size_t region = add_region(start, split, node);
+                init_pages(start, split, region);
+            }
+
+            // the deferred part is a region of its own, so that freeing an early page never merges with a buddy whose PFN entry
+            // is not set up yet
+            if (split < end)
+            {
+                deferred[deferred_count++] = {split, end, add_region(split, end, node)};
+            }
+        }
+    } // namespace
+
+    void pmm_add_region(std::uintptr_t base, std::size_t length)
     {
-        lock::spinlock_guard guard(pmm_alloc_lock);
-        while (auto* ptr = free_list.get_front())
+        // one region per node the range touches
+        std::uintptr_t end = base + length;
+        while (base < end)
         {
-            free_list.pop_front();
-            lock::spinlock_guard page_access_guard(ptr->get_lock());
-            ptr->set_type(page_info::USED);
+            std::uintptr_t node_end = 0;
+            std::size_t node = numa_node_of(base, &node_end);
+            std::uintptr_t limit = std::min(end, node_end);
+            add_node_region(base, limit, node);
+            base = limit;
+        }
+    }
 
-            return mm::make_virtual<void>(pfn_to_page(*ptr));
+    void pmm_init_deferred()
+    {
+        std::size_t pages = 0;
+        while (true)
+        {
+            std::size_t chunk = std::direct_atomic_fetch_add(&next_chunk, 1UL, std::memory_order_relaxed);
+
+            std::size_t i = 0;
+            while (i < deferred_count && chunk >= chunks_of(deferred[i]))
+            {
+                chunk -= chunks_of(deferred[i]);
+                i++;
+            }
+
+            if (i == deferred_count)
+            {
+                break;
+            }
+
+            const auto& range = deferred[i];
+            std::size_t window = (range.start / DEFERRED_CHUNK_PAGES + chunk) * DEFERRED_CHUNK_PAGES;
+            std::size_t start = std::max(range.start, window);
+            std::size_t end = std::min(range.end, window + DEFERRED_CHUNK_PAGES);
+
+            init_pages(start, end, range.region);
+            pages += end - start;
         }
 
-        return nullptr;
+        if (pages != 0)
+        {
+            klog::log("pmm: set up %lu deferred pages", pages);
+        }
     }
 
-    auto pmm_free(void* addr)
+    auto pmm_allocate(std::size_t order) -> void*
     {
-        auto& pfn = page_to_pfn(addr);
-        lock::spinlock_guard page_access_guard(pfn.get_lock());
-        pfn.set_type(page_info::FREE);
-        lock::spinlock_guard guard(pmm_alloc_lock);
-        free_list.add_front(&pfn);
+        if (order > PMM_MAX_ORDER)
+        {
+            return nullptr;
+        }
+
+        // the cache is only ever touched by its own core, so keeping interrupts off is enough to protect it
+        lock::interrupt_save_guard int_guard;
+        pmm_section section;
+
+        if (order == 0)
+        {
+            auto& local = smp::core_local::get();
+            auto& cache = local.page_cache;
+            if (cache.count == 0)
+            {
+                refill_cache(cache);
+                // a refill that came back empty is an allocation failure, not a refill
+                if (cache.count != 0)
+                {
+                    stat_add(local.mem_stats.pmm_refills);
+                }
+            }
+
+            if (cache.count == 0)
+            {
+                return nullptr;
+            }
+
+            stat_add(local.mem_stats.pmm_allocs);
+            return cache.pages[--cache.count];
+        }
+
+        auto* head = allocate_block(order);
+        if (head == nullptr)
+        {
+            return nullptr;
+        }
+
+        count(&mem_stats::pmm_allocs, 1UL << order);
+        return mm::make_virtual<void>(pfn_to_page(*head));
     }
 
-    auto pmm_get_free_list() -> std::intrusive_list<page_info>& { return free_list; }
+    void pmm_free(void* addr, std::size_t order)
+    {
+        lock::interrupt_save_guard int_guard;
+        pmm_section section;
+
+        if (order == 0)
+        {
+            auto& local = smp::core_local::get();
+            auto& cache = local.page_cache;
+            if (cache.count == config::get_val<"pmm.cache.high">)
+            {
+                drain_cache(cache);
+                stat_add(local.mem_stats.pmm_drains);
+            }
+
+            cache.pages[cache.count++] = addr;
+            stat_add(local.mem_stats.pmm_frees);
+            return;
+        }
+
+        count(&mem_stats::pmm_frees, 1UL << order);
+
+        std::size_t index = make_physical(addr) / paging::PAGE_SMALL_SIZE;
+        auto& zone = zone_of(index);
+        lock::spinlock_guard guard(zone.lock);
+        buddy_free(zone, index, order);
+    }
 } // namespace mm
@@ -1,90 +1,221 @@
-#include "bitmanip.h"
 #include "bits/mathhelper.h"
-#include "bits/utils.h"
 #include <algorithm>
-#include <bitset>
 #include <cstddef>
 #include <cstdint>
-#include <cstring>
-#include <debug/debug.h>
+#include <misc/cast.h>
 #include <mm/mm.h>
-#include <utility>
-#include <utils/utils.h>
-#include <utils/id_allocator.h>
+#include <mm/slab.h>
+#include <smp/smp.h>
+#include <sync/spinlock.h>
 
 namespace mm
 {
-    class slab
+    namespace
     {
-        dynamic_id_allocator alloc;
-        void* buf;
-        std::size_t size;
-        std::size_t obj_size;
-    public:
-        constexpr slab(void* buf, std::size_t len, std::size_t obj_size)
-            : alloc(len), buf(buf), size(len), obj_size(obj_size)
+        inline constexpr std::size_t MIN_ORDER = config::get_val<"slab.min_order">;
+        inline constexpr std::size_t MAX_ORDER = config::get_val<"slab.max_order">;
+        inline constexpr std::size_t SLAB_SIZE = 1UL << config::get_val<"slab.slab_size_order">;
+        // slabs are single buddy blocks, which makes them aligned to their size
+        inline constexpr std::size_t SLAB_PMM_ORDER = config::get_val<"slab.slab_size_order"> - std::ceil_logbase2(paging::PAGE_SMALL_SIZE);
+
+        static_assert(SLAB_SIZE >= paging::PAGE_SMALL_SIZE && SLAB_PMM_ORDER <= PMM_MAX_ORDER);
+    } // namespace
+
+    // lives at the start of every slab, the objects follow it aligned to their size
+    struct slab_header
+    {
+        slab_cache* owner;
+        slab_header* prev;
+        slab_header* next;
+        // singly linked through the first word of each free object
+        void* free_objects;
+        std::uint32_t order;
+        std::uint32_t in_use;
+        // objects at or past this index have never been handed out, so they are not on the free list yet
+        std::uint32_t untouched;
+        std::uint32_t capacity;
+    };
+
+    namespace
+    {
+        void push_slab(slab_header*& list, slab_header* slab)
         {
+            slab->prev = nullptr;
+            slab->next = list;
+            if (list != nullptr)
+            {
+                list->prev = slab;
+            }
+            list = slab;
         }
 
-        constexpr slab(const slab& rhs) = default;
+        void unlink_slab(slab_header*& list, slab_header* slab)
+        {
+            if (slab->prev != nullptr)
+            {
+                slab->prev->next = slab->next;
+            }
+            else
+            {
+                list = slab->next;
+            }
 
-        constexpr slab() : alloc(0), buf(nullptr) {}
+            if (slab->next != nullptr)
+            {
+                slab->next->prev = slab->prev;
+            }
+        }
 
-        void* allocate()
+        INLINE auto first_object_offset(std::size_t order) -> std::size_t
         {
-            return (void*)((std::uintptr_t) buf + obj_size * alloc.allocate());
+            return std::div_roundup(sizeof(slab_header), 1UL << order) << order;
         }
 
-        void free(void* index)
+        void mark_pages(void* slab, page_info::type type)
         {
-            alloc.free(((std::uintptr_t)buf - (std::uintptr_t)index) / obj_size);
+            for (std::size_t i = 0; i < SLAB_SIZE; i += paging::PAGE_SMALL_SIZE)
+            {
+                (void)page_to_pfn(as_uptr(slab) + i).set_type(type);
+            }
         }
 
-        bool in_bounds(void* ptr)
+        auto grow(slab_cache& cache, std::size_t order) -> slab_header*
         {
-            auto p = (std::uintptr_t)ptr;
-            auto b = (std::uintptr_t)buf;
+            void* buffer = pmm_allocate(SLAB_PMM_ORDER);
+            if (buffer == nullptr)
+            {
+                return nullptr;
+            }
+
+            // every page is tagged so that slab_free can tell slab objects apart from plain page allocations
+            mark_pages(buffer, page_info::USED_SLAB);
 
-            return p > b && p < (b + obj_size * size);
+            auto* slab = new (buffer) slab_header{
+                .owner = &cache,
+                .prev = nullptr,
+                .next = nullptr,
+                .free_objects = nullptr,
+                .order = static_cast<std::uint32_t>(order),
+                .in_use = 0,
+                .untouched = 0,
+                .capacity = static_cast<std::uint32_t>((SLAB_SIZE - first_object_offset(order)) >> order),
+            };
+
+            return slab;
         }
-    };
 
-    inline constexpr auto MIN_ORDER = config::get_val<"slab.min_order">;
-    inline constexpr auto MAX_ORDER = config::get_val<"slab.max_order">;
-    inline constexpr auto SLAB_SIZE_ORDER = config::get_val<"slab.slab_size_order">;
+        void release(slab_header* slab)
+        {
+            mark_pages(slab, page_info::USED);
+            pmm_free(slab, SLAB_PMM_ORDER);
+        }
+
+        auto take_object(slab_header& slab) -> void*
+        {
+            void* object = slab.free_objects;
+            if (object != nullptr)
+            {
+                slab.free_objects = *as_ptr<void*>(object);
+            }
+            else
+            {
+                object = as_vptr(as_uptr(&slab) + first_object_offset(slab.order) + (std::size_t(slab.untouched++) << slab.order));
+            }
+
+            slab.in_use++;
+            return object;
+        }
+    } // namespace
 
-    static slab BUILTIN_SLABS[MAX_ORDER - MIN_ORDER + 1];
-    void init_slab()
+    auto slab_allocate(std::size_t size) -> void*
     {
-        // slab  shall contain object caches of size 2^n to 2^m,
-        // in which n = config::get_val<"slab.min_order"> and m = config::get_val<"slab.max_order">
-        // The total size of each object cache shall be 2^(config::get_val<"slab.slab_size_order">
-        std::size_t idx = 0;
-        for (std::size_t order = MIN_ORDER; order <= MAX_ORDER; order++)
+        if (size > (1UL << MAX_ORDER))
+        {
+            return pmm_allocate(std::ceil_logbase2(std::div_roundup(size, paging::PAGE_SMALL_SIZE)));
+        }
+
+        std::size_t order = std::max<std::size_t>(std::ceil_logbase2(size), MIN_ORDER);
+
+        lock::interrupt_save_guard int_guard;
+        auto& local = smp::core_local::get();
+        auto& cache = local.slab_caches[order - MIN_ORDER];
+        lock::spinlock_guard guard(cache.lock);
+
+        slab_header* slab = cache.partial;
+        if (slab == nullptr)
+        {
+            stat_add(local.mem_stats.slab_misses);
+            slab = cache.empty;
+            cache.empty = nullptr;
+
+            if (slab == nullptr && (slab = grow(cache, order)) == nullptr)
+            {
+                return nullptr;
+            }
+
+            push_slab(cache.partial, slab);
+        }
+        else
         {
-            BUILTIN_SLABS[idx] = slab((void*)(config::get_val<"mmap.start.slab"> + idx * (1 << SLAB_SIZE_ORDER)),
-                                      1 << (SLAB_SIZE_ORDER - order), 1 << order);
+            stat_add(local.mem_stats.slab_hits);
         }
+
+        void* object = take_object(*slab);
+        if (slab->in_use == slab->capacity)
+        {
+            unlink_slab(cache.partial, slab);
+        }
+
+        return object;
     }
 
-    auto slab_allocate(std::size_t n) -> void*
+    void slab_free(void* ptr)
     {
-        std::size_t order = std::ceil_logbase2(n);
-        if (order > MAX_ORDER)
+        auto& info = page_to_pfn(ptr);
+        if (info.get_type() != page_info::USED_SLAB)
         {
-            debug::panic("slab: cannot find object cache of the proper size", false);
-            return nullptr;
+            pmm_free(ptr, info.get_order());
+            return;
         }
 
-        order = std::max(order, MIN_ORDER);
+        auto* slab = as_ptr<slab_header>(as_uptr(ptr) & ~(SLAB_SIZE - 1));
+
+        lock::interrupt_save_guard int_guard;
+        auto& cache = *slab->owner;
+        lock::spinlock_guard guard(cache.lock);
 
-        return BUILTIN_SLABS[order - MIN_ORDER].allocate();
+        bool was_full = slab->in_use == slab->capacity;
+        *as_ptr<void*>(ptr) = slab->free_objects;
+        slab->free_objects = ptr;
+        slab->in_use--;
+
+        if (was_full)
+        {
+            push_slab(cache.partial, slab);
+        }
+
+        if (slab->in_use == 0)
+        {
+            unlink_slab(cache.partial, slab);
+            if (cache.empty == nullptr)
+            {
+                cache.empty = slab;
+            }
+            else
+            {
+                release(slab);
+            }
+        }
     }
 
-    void slab_free(void* ptr)
+    auto slab_size(void* ptr) -> std::size_t
     {
-        std::uintptr_t p = (std::uintptr_t)ptr;
-        auto slab = (p - config::get_val<"mmap.start.slab">) / (1 << SLAB_SIZE_ORDER);
-        BUILTIN_SLABS[slab].free(ptr);
+        auto& info = page_to_pfn(ptr);
+        if (info.get_type() != page_info::USED_SLAB)
+        {
+            return paging::PAGE_SMALL_SIZE << info.get_order();
+        }
+
+        return 1UL << as_ptr<slab_header>(as_uptr(ptr) & ~(SLAB_SIZE - 1))->order;
     }
 } // namespace mm
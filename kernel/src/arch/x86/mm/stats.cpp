@@ -0,0 +1,113 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <kinit/boot_resource.h>
+#include <mm/malloc.h>
+#include <mm/paging/paging.h>
+#include <mm/stats.h>
+#include <printf.h>
+#include <smp/smp.h>
+
+namespace mm
+{
+    namespace
+    {
+        constexpr const char* FAULT_NAMES[FAULT_KIND_COUNT] = {
+            "KernelDemandZero", "UserPopulate", "CowCopy", "CowReuse", "Unhandled",
+        };
+
+        // appends to a fixed buffer, dropping whatever does not fit but always leaving room for the terminator
+        struct report_writer
+        {
+            char* buffer;
+            std::size_t size;
+            std::size_t length{};
+
+            void operator()(char ch)
+            {
+                if (length + 1 < size)
+                {
+                    buffer[length++] = ch;
+                }
+            }
+        };
+
+        auto load(const std::uint64_t& counter) -> std::uint64_t { return std::direct_atomic_load_n(&counter, std::memory_order_relaxed); }
+
+        void accumulate(mem_stats& total, const mem_stats& core)
+        {
+            total.pmm_allocs += load(core.pmm_allocs);
+            total.pmm_frees += load(core.pmm_frees);
+            total.pmm_refills += load(core.pmm_refills);
+            total.pmm_drains += load(core.pmm_drains);
+            total.slab_hits += load(core.slab_hits);
+            total.slab_misses += load(core.slab_misses);
+            for (std::size_t i = 0; i < FAULT_KIND_COUNT; i++)
+            {
+                total.faults[i] += load(core.faults[i]);
+            }
+            total.page_tables_allocated += load(core.page_tables_allocated);
+            total.page_tables_freed += load(core.page_tables_freed);
+        }
+    } // namespace
+
+    auto collect_mem_stats() -> mem_stats
+    {
+        mem_stats total{};
+        for (std::size_t i = 0; i < boot_resource::instance().core_count(); i++)
+        {
+            accumulate(total, smp::core_local::get(i).mem_stats);
+        }
+
+        return total;
+    }
+
+    auto format_meminfo(char* buffer, std::size_t size) -> std::size_t
+    {
+        if (size == 0)
+        {
+            return 0;
+        }
+
+        report_writer out{buffer, size};
+        auto emit = [&](char ch) { out(ch); };
+
+        auto stats = collect_mem_stats();
+        auto heap = alloc::get_heap_info();
+
+        std::printf_callback(emit, "PmmAllocPages:     %lu\n", stats.pmm_allocs);
+        std::printf_callback(emit, "PmmFreePages:      %lu\n", stats.pmm_frees);
+        std::printf_callback(emit, "PmmCacheRefills:   %lu\n", stats.pmm_refills);
+        std::printf_callback(emit, "PmmCacheDrains:    %lu\n", stats.pmm_drains);
+        std::printf_callback(emit, "SlabHits:          %lu\n", stats.slab_hits);
+        std::printf_callback(emit, "SlabMisses:        %lu\n", stats.slab_misses);
+        std::printf_callback(emit, "HeapSize:          %lu kB\n", heap.size / 1024);
+        std::printf_callback(emit, "HeapUsed:          %lu kB\n", heap.used / 1024);
+        std::printf_callback(emit, "HeapFree:          %lu kB\n", heap.free / 1024);
+        std::printf_callback(emit, "HeapFreeBlocks:    %lu\n", heap.free_blocks);
+        std::printf_callback(emit, "HeapLargestFree:   %lu kB\n", heap.largest_free / 1024);
+        std::uint64_t page_tables = stats.page_tables_allocated - stats.page_tables_freed;
+        std::printf_callback(emit, "PageTables:        %lu kB\n", page_tables * paging::PAGE_SMALL_SIZE / 1024);
+        for (std::size_t i = 0; i < FAULT_KIND_COUNT; i++)
+        {
+            std::printf_callback(emit, "Faults%-12s %lu\n", FAULT_NAMES[i], stats.faults[i]);
+        }
+
+        // the per-core breakdown shows whether the work is spread evenly
+        for (std::size_t i = 0; i < boot_resource::instance().core_count(); i++)
+        {
+            mem_stats core{};
+            accumulate(core, smp::core_local::get(i).mem_stats);
+            std::printf_callback(emit, "Core%lu: pmm %lu/%lu slab %lu/%lu faults", i, core.pmm_allocs, core.pmm_frees, core.slab_hits,
+                                 core.slab_misses);
+            for (auto count : core.faults)
+            {
+                std::printf_callback(emit, " %lu", count);
+            }
+            std::printf_callback(emit, "\n");
+        }
+
+        buffer[out.length] = '\0';
+        return out.length;
+    }
+} // namespace mm
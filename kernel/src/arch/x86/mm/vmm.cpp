@@ -1,4 +1,5 @@
 #include "bits/mathhelper.h"
+#include <algorithm>
 #include <asm/asm_cpp.h>
 #include <config.h>
 #include <cstddef>
@@ -10,120 +11,420 @@
 #include <mm/paging/paging.h>
 #include <mm/paging/paging_entries.h>
 #include <new>
+#include <smp/smp.h>
+#include <sync/spinlock.h>
 
 namespace mm
 {
-    /*
-    struct vmm_block_header
+    // free ranges of the vmm window, kept in an AVL tree ordered by address
+    // every node also tracks the largest range in its subtree, which lets allocation find the lowest fitting range in O(log n)
+    struct vmm_range
     {
-        vmm_block_header* back;
-        vmm_block_header* next;
-        std::size_t size;
-        std::uintptr_t data;
-        std::size_t flag;
+        std::uintptr_t start;
+        std::size_t pages;
+        std::size_t max_pages;
+        vmm_range* left;
+        vmm_range* right;
+        int height;
     };
 
     namespace
     {
-        vmm_block_header* root = nullptr;
-        vmm_block_header* last = nullptr;
-        std::size_t malloced_bytes = 0;
+        vmm_range* free_ranges = nullptr;
+        lock::spinlock vmm_lock;
 
-        inline auto next_of(vmm_block_header* header) -> vmm_block_header* { return header->next; }
-    } // namespace
-    inline constexpr auto ALIGN = paging::PAGE_SMALL_SIZE;
+        // how many frames vmm_free() unmaps before it shoots them down and frees them
+        inline constexpr std::size_t FREE_BATCH = 64;
 
-    constexpr auto is_free(vmm_block_header& header) -> bool { return std::get_bit<0>(header.flag); }
-    constexpr void set_free(vmm_block_header& header, bool new_value = true) { std::set_bit<0>(header.flag, new_value); }
-    constexpr auto make_flags(bool is_free) -> std::size_t
-    {
-        std::size_t val = 0;
-        std::set_bit<0>(val, is_free);
-        return val;
-    }
+        struct freed_frame
+        {
+            std::uintptr_t physical_addr;
+            std::size_t order;
+        };
 
-    auto get_alloced_size() -> std::size_t { return malloced_bytes; }
+        INLINE auto height_of(vmm_range* node) -> int { return node != nullptr ? node->height : 0; }
+        INLINE auto max_of(vmm_range* node) -> std::size_t { return node != nullptr ? node->max_pages : 0; }
+        INLINE auto end_of(vmm_range* node) -> std::uintptr_t { return node->start + node->pages * paging::PAGE_SMALL_SIZE; }
 
-    void init()
-    {
-        root = last = new vmm_block_header { nullptr, nullptr, config::get<"vmm-size">, config::get<"mmap.start.vmm">, make_flags(true) };
-    }
+        auto update(vmm_range* node) -> vmm_range*
+        {
+            node->height = std::max(height_of(node->left), height_of(node->right)) + 1;
+            node->max_pages = std::max({node->pages, max_of(node->left), max_of(node->right)});
+            return node;
+        }
 
-    auto vmalloc(std::size_t size) -> void*
-    {
-        size = (size + (ALIGN - 1)) & ~(ALIGN - 1);
-        if (!size)
+        auto rotate_right(vmm_range* node) -> vmm_range*
         {
-            return nullptr;
+            vmm_range* pivot = node->left;
+            node->left = pivot->right;
+            pivot->right = update(node);
+            return update(pivot);
         }
 
-        malloced_bytes += size;
+        auto rotate_left(vmm_range* node) -> vmm_range*
+        {
+            vmm_range* pivot = node->right;
+            node->right = pivot->left;
+            pivot->left = update(node);
+            return update(pivot);
+        }
 
-        vmm_block_header* hdr = root;
-        while (hdr <= last)
+        auto rebalance(vmm_range* node) -> vmm_range*
         {
-            if (is_free(*hdr) && hdr->size >= size)
+            update(node);
+            int balance = height_of(node->left) - height_of(node->right);
+
+            if (balance > 1)
             {
-                if (hdr->size - size > 0)
+                if (height_of(node->left->left) < height_of(node->left->right))
                 {
-                    hdr->size = size;
-                    auto* next_block = new vmm_block_header{hdr, hdr->next, hdr->size - size, hdr->data + size, make_flags(true)};
+                    node->left = rotate_left(node->left);
+                }
+                return rotate_right(node);
+            }
 
-                    hdr->next = next_block;
+            if (balance < -1)
+            {
+                if (height_of(node->right->right) < height_of(node->right->left))
+                {
+                    node->right = rotate_right(node->right);
+                }
+                return rotate_left(node);
+            }
 
-                    if (hdr == last)
-                    {
-                        last = next_block;
-                    }
-                    else
-                    {
-                        next_of(next_block)->back = next_block;
-                    }
+            return node;
+        }
+
+        auto insert(vmm_range* root, vmm_range* node) -> vmm_range*
+        {
+            if (root == nullptr)
+            {
+                return update(node);
+            }
+
+            if (node->start < root->start)
+            {
+                root->left = insert(root->left, node);
+            }
+            else
+            {
+                root->right = insert(root->right, node);
+            }
+
+            return rebalance(root);
+        }
+
+        auto remove_min(vmm_range* root, vmm_range*& min) -> vmm_range*
+        {
+            if (root->left == nullptr)
+            {
+                min = root;
+                return root->right;
+            }
+
+            root->left = remove_min(root->left, min);
+            return rebalance(root);
+        }
+
+        auto remove(vmm_range* root, std::uintptr_t start) -> vmm_range*
+        {
+            if (root == nullptr)
+            {
+                return nullptr;
+            }
+
+            if (start < root->start)
+            {
+                root->left = remove(root->left, start);
+            }
+            else if (start > root->start)
+            {
+                root->right = remove(root->right, start);
+            }
+            else
+            {
+                if (root->left == nullptr || root->right == nullptr)
+                {
+                    return root->left != nullptr ? root->left : root->right;
                 }
 
-                set_free(*hdr, false);
+                vmm_range* successor = nullptr;
+                vmm_range* right = remove_min(root->right, successor);
+                successor->left = root->left;
+                successor->right = right;
+                return rebalance(successor);
+            }
 
-                return (void*)hdr->data;
+            return rebalance(root);
+        }
+
+        // takes pages from the front of the lowest range that can hold them
+        auto take_first_fit(vmm_range* root, std::size_t pages, std::uintptr_t& out) -> vmm_range*
+        {
+            if (max_of(root->left) >= pages)
+            {
+                root->left = take_first_fit(root->left, pages, out);
+                return update(root);
             }
-            hdr = next_of(hdr);
+
+            if (root->pages >= pages)
+            {
+                out = root->start;
+                root->start += pages * paging::PAGE_SMALL_SIZE;
+                root->pages -= pages;
+
+                if (root->pages == 0)
+                {
+                    vmm_range* node = root;
+                    root = remove(root, node->start);
+                    delete node;
+                    return root;
+                }
+
+                return update(root);
+            }
+
+            root->right = take_first_fit(root->right, pages, out);
+            return update(root);
         }
-        klog::panic("virtual memory exhausted");
-    }
 
-    void vfree(void* buffer) { klog::log("warning: vfree not implemented"); }*/
+        // the range that ends exactly at addr, if any
+        auto find_ending_at(std::uintptr_t addr) -> vmm_range*
+        {
+            vmm_range* candidate = nullptr;
+            vmm_range* node = free_ranges;
+            while (node != nullptr)
+            {
+                if (node->start < addr)
+                {
+                    candidate = node;
+                    node = node->right;
+                }
+                else
+                {
+                    node = node->left;
+                }
+            }
+
+            return candidate != nullptr && end_of(candidate) == addr ? candidate : nullptr;
+        }
+
+        auto find_starting_at(std::uintptr_t addr) -> vmm_range*
+        {
+            vmm_range* node = free_ranges;
+            while (node != nullptr && node->start != addr)
+            {
+                node = addr < node->start ? node->left : node->right;
+            }
+
+            return node;
+        }
+
+        void release_range(std::uintptr_t start, std::size_t pages)
+        {
+            if (auto* prev = find_ending_at(start))
+            {
+                free_ranges = remove(free_ranges, prev->start);
+                start = prev->start;
+                pages += prev->pages;
+                delete prev;
+            }
+
+            if (auto* next = find_starting_at(start + pages * paging::PAGE_SMALL_SIZE))
+            {
+                free_ranges = remove(free_ranges, next->start);
+                pages += next->pages;
+                delete next;
+            }
+
+            free_ranges = insert(free_ranges, new vmm_range{start, pages, pages, nullptr, nullptr, 1});
+        }
 
-    static std::uintptr_t start = config::get_val<"mmap.start.vmm"> + paging::PAGE_SMALL_SIZE;
+        void init_ranges()
+        {
+            std::uintptr_t start = config::get_val<"mmap.start.vmm"> + paging::PAGE_SMALL_SIZE;
+            std::size_t pages = config::get_val<"vmm-size"> / paging::PAGE_SMALL_SIZE - 1;
+            free_ranges = new vmm_range{start, pages, pages, nullptr, nullptr, 1};
+        }
+    } // namespace
 
+    // every allocation is preceded by an unmapped guard page, so that stacks overflowing into it fault instead of
+    // silently corrupting the allocation below
     auto vmm_allocate(std::size_t pages) -> void*
     {
-        auto* ret = as_vptr(start);
-        start += (pages + 1) * paging::PAGE_SMALL_SIZE;
-        return ret;
+        lock::spinlock_guard guard(vmm_lock);
+        if (free_ranges == nullptr)
+        {
+            init_ranges();
+        }
+
+        // allocations that can hold a large page start on a 2 MiB boundary, the slack taken to get there is given back
+        std::size_t slack = pages >= paging::PAGE_MEDIUM_TO_SMALL_RATIO ? paging::PAGE_MEDIUM_TO_SMALL_RATIO - 1 : 0;
+        if (max_of(free_ranges) < pages + 1 + slack)
+        {
+            klog::panic("virtual memory exhausted");
+        }
+
+        std::uintptr_t start = 0;
+        free_ranges = take_first_fit(free_ranges, pages + 1 + slack, start);
+
+        std::uintptr_t ptr = std::div_roundup(start + paging::PAGE_SMALL_SIZE, paging::PAGE_MEDIUM_SIZE) * paging::PAGE_MEDIUM_SIZE;
+        if (slack == 0)
+        {
+            ptr = start + paging::PAGE_SMALL_SIZE;
+        }
+
+        std::size_t head = (ptr - paging::PAGE_SMALL_SIZE - start) / paging::PAGE_SMALL_SIZE;
+        if (head != 0)
+        {
+            release_range(start, head);
+        }
+
+        if (slack != head)
+        {
+            release_range(ptr + pages * paging::PAGE_SMALL_SIZE, slack - head);
+        }
+
+        return as_vptr(ptr);
     }
 
     void vmm_free(void* pointer, std::size_t pages)
     {
-        (void)pointer;
-        (void)pages;
+        std::uintptr_t start = as_uptr(pointer);
+        auto* table = paging::kernel_table();
+
+        // frames are only handed back to the pmm once no core can reach them through a stale translation anymore, so they
+        // are collected and freed after each shootdown
+        freed_frame frames[FREE_BATCH];
+        std::size_t frame_count = 0;
+        std::uintptr_t flushed = start;
+        auto release = [&](std::uintptr_t end) {
+            if (end != flushed)
+            {
+                paging::flush_tlb_range(flushed, (end - flushed) / paging::PAGE_SMALL_SIZE);
+            }
+
+            for (std::size_t j = 0; j < frame_count; j++)
+            {
+                mm::pmm_free(mm::make_virtual<void>(frames[j].physical_addr), frames[j].order);
+            }
+
+            frame_count = 0;
+            flushed = end;
+        };
+
+        // one last level table, or one large page, at a time
+        for (std::size_t i = 0; i < pages;)
+        {
+            std::uintptr_t addr = start + i * paging::PAGE_SMALL_SIZE;
+            std::size_t run = std::min(pages - i, (paging::PAGE_MEDIUM_SIZE - addr % paging::PAGE_MEDIUM_SIZE) / paging::PAGE_SMALL_SIZE);
+
+            if (run == paging::PAGE_MEDIUM_TO_SMALL_RATIO && paging::find_leaf_table(table, addr) == nullptr)
+            {
+                paging::page_type type = paging::SMALL;
+                std::uintptr_t physical_addr = paging::unmap_page(addr, &type);
+                if (physical_addr != 0)
+                {
+                    frames[frame_count++] = {physical_addr, type == paging::MEDIUM ? PMM_MEDIUM_ORDER : 0};
+                    if (frame_count == FREE_BATCH)
+                    {
+                        release(addr + run * paging::PAGE_SMALL_SIZE);
+                    }
+                }
+            }
+            else
+            {
+                paging::unmap_range(table, addr, run, [&](std::size_t j, std::uintptr_t physical_addr) {
+                    frames[frame_count++] = {physical_addr, 0};
+                    if (frame_count == FREE_BATCH)
+                    {
+                        release(addr + (j + 1) * paging::PAGE_SMALL_SIZE);
+                    }
+                });
+            }
+
+            i += run;
+        }
+
+        release(start + pages * paging::PAGE_SMALL_SIZE);
+
+        lock::spinlock_guard guard(vmm_lock);
+        release_range(start - paging::PAGE_SMALL_SIZE, pages + 1);
+    }
+
+    void map_fresh_pages(std::uintptr_t vaddr, std::size_t pages, bool clean)
+    {
+        for (std::size_t i = 0; i < pages;)
+        {
+            std::uintptr_t addr = vaddr + i * paging::PAGE_SMALL_SIZE;
+            if (addr % paging::PAGE_MEDIUM_SIZE == 0 && pages - i >= paging::PAGE_MEDIUM_TO_SMALL_RATIO)
+            {
+                // fall back to small pages when physical memory is too fragmented for a 2 MiB block
+                if (void* block = clean ? pmm_allocate_clean(PMM_MEDIUM_ORDER) : pmm_allocate(PMM_MEDIUM_ORDER))
+                {
+                    expect(paging::request_page(paging::MEDIUM, addr, mm::make_physical(block), {.rw = true}, false), "illegal state?");
+                    invlpg(addr);
+                    i += paging::PAGE_MEDIUM_TO_SMALL_RATIO;
+                    continue;
+                }
+            }
+
+            // small pages up to the next 2 MiB boundary, which all live in the same last level table
+            std::size_t run = std::min(pages - i, (paging::PAGE_MEDIUM_SIZE - addr % paging::PAGE_MEDIUM_SIZE) / paging::PAGE_SMALL_SIZE);
+            auto range = paging::map_range(
+                paging::kernel_table(), addr,
+                [clean](std::size_t) {
+                    return mm::make_physical(expect_nonnull(clean ? pmm_allocate_clean() : pmm_allocate(), "cannot allocate physical memory"));
+                },
+                run, {.rw = true});
+            paging::invalidate_local(range);
+            i += run;
+        }
     }
 
     auto vmm_allocate_mapped(std::size_t pages) -> void*
     {
         auto* ptr = vmm_allocate(pages);
-        for (std::size_t i = 0; i < pages; i++)
+        map_fresh_pages(as_uptr(ptr), pages, true);
+        return ptr;
+    }
+
+    auto allocate_stack(bool demand_paged) -> void*
+    {
+        if (!demand_paged)
         {
-            expect(paging::request_page(paging::SMALL, as_uptr(ptr) + i * paging::PAGE_SMALL_SIZE,
-                                        mm::make_physical(expect_nonnull(mm::pmm_allocate_clean())), {.rw = true}, false),
-                   "illegal state?");
-            invlpg(as_uptr(ptr) + i * paging::PAGE_SMALL_SIZE);
+            return as_vptr(as_uptr(vmm_allocate_mapped(STACK_PAGES)) + STACK_PAGES * paging::PAGE_SMALL_SIZE);
         }
 
-        return ptr;
+        std::uintptr_t start = as_uptr(vmm_allocate(STACK_PAGES));
+        std::uintptr_t top = start + STACK_PAGES * paging::PAGE_SMALL_SIZE;
+        std::uintptr_t prefault = top - STACK_PREFAULT_PAGES * paging::PAGE_SMALL_SIZE;
+
+        for (std::uintptr_t addr = start; addr < prefault; addr += paging::PAGE_SMALL_SIZE)
+        {
+            expect(paging::reserve_page(addr, {.rw = true}), "illegal state?");
+        }
+
+        map_fresh_pages(prefault, STACK_PREFAULT_PAGES, true);
+
+        return as_vptr(top);
     }
 
-    auto allocate_stack() -> void*
+    void free_stack(void* top) { vmm_free(as_vptr(as_uptr(top) - STACK_PAGES * paging::PAGE_SMALL_SIZE), STACK_PAGES); }
+
+    void refill_fault_reserve()
     {
-        static constexpr auto STACK_SIZE = 256;
-        return as_vptr(as_uptr(vmm_allocate_mapped(STACK_SIZE)) + STACK_SIZE * paging::PAGE_SMALL_SIZE);
+        lock::interrupt_save_guard irq;
+        auto& reserve = smp::core_local::get().fault_reserve;
+        while (reserve.count < FAULT_RESERVE_PAGES)
+        {
+            void* page = pmm_allocate_clean();
+            if (page == nullptr)
+            {
+                return;
+            }
+
+            reserve.pages[reserve.count++] = page;
+        }
     }
 } // namespace mm
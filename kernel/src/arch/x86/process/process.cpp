@@ -23,7 +23,8 @@ namespace proc
         }
     } // namespace
 
-    auto process::make_thread(const context& inital_context, std::size_t core) -> std::uint32_t
+    auto process::make_thread(const context& inital_context, std::size_t core, std::uint8_t priority, std::uint64_t affinity,
+                              thread_state state) -> std::uint32_t
     {
         SPINLOCK_SYNC_BLOCK;
 
@@ -37,7 +38,10 @@ namespace proc
         auto& th = threads[tid];
         th.id = task_id{id32, pid};
         th.ctx = inital_context;
-        th.state = proc::thread_state::RUNNING;
+        th.state = state;
+        th.priority = priority;
+        th.affinity = affinity;
+        th.sched_core = core;
 
         smp::core_local::get(core).scheduler.add_task(&th);
         return tid;
@@ -57,24 +61,16 @@ namespace proc
         if (__save_ctx_for_reschedule()) {}
     }
 
-    auto make_kthread_args(kthread_fn_args_t thread_fn, std::uint64_t extra, std::size_t core) -> std::uint32_t
+    auto make_kthread_args(kthread_fn_args_t thread_fn, std::uint64_t extra, std::size_t core, std::uint8_t priority, std::uint64_t affinity)
+        -> std::uint32_t
     {
-        auto* pages = mm::pmm_allocate_clean();
-
-        if (pages == nullptr)
-        {
-            klog::panic("failed to allocate buffers for kernel thread stack and page table");
-        }
-
-        paging::copy_kernel_page_tables(as_ptr(pages), smp::core_local::get(core).pagemap);
-
         return get_process(0).make_thread(context_builder(context_builder::KERNEL, as_uptr(thread_fn))
                                               .set_reg(context::RDI, extra)
                                               .set_flag(cpuflags::IF)
-                                              .set_stack(as_uptr(mm::allocate_stack()))
-                                              .set_cr3(as_uptr(pages))
+                                              .set_stack(as_uptr(mm::allocate_stack(true)))
+                                              .set_cr3(as_uptr(paging::kernel_table()))
                                               .build(),
-                                          core);
+                                          core, priority, affinity);
     }
 
     auto make_kthread_args(kthread_fn_args_t thread_fn, std::uint64_t extra) -> std::uint32_t
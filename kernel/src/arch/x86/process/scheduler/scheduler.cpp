@@ -1,132 +1,384 @@
 #include <process/scheduler/scheduler.h>
 #include "klog/klog.h"
+#include <config.h>
 #include <cstddef>
+#include <kinit/boot_resource.h>
+#include <misc/kassert.h>
 #include <process/process.h>
 #include <smp/smp.h>
 
 namespace scheduler
 {
-    /* TODO: switch to heap sched
-    void scheduler::heap_update(std::size_t target_index, std::int64_t priority)
+    void run_list::push_back(proc::thread* thread)
     {
-        auto old_priority = task_heap[target_index].task_priority;
-        task_heap[target_index].task_priority = priority;
-        if (priority > old_priority)
+        thread->sched_prev = tail;
+        thread->sched_next = nullptr;
+        if (tail != nullptr)
         {
-            std::size_t index = target_index;
-            while (!is_root(index) && priority > task_heap[parent(index)].task_priority)
-            {
-                std::size_t new_index = parent(index);
-                heap_swap(index, new_index);
-                index = new_index;
-            }
+            tail->sched_next = thread;
+        }
+        else
+        {
+            head = thread;
+        }
+        tail = thread;
+    }
+
+    void run_list::push_front(proc::thread* thread)
+    {
+        thread->sched_prev = nullptr;
+        thread->sched_next = head;
+        if (head != nullptr)
+        {
+            head->sched_prev = thread;
+        }
+        else
+        {
+            tail = thread;
+        }
+        head = thread;
+    }
+
+    void run_list::remove(proc::thread* thread)
+    {
+        if (thread->sched_prev != nullptr)
+        {
+            thread->sched_prev->sched_next = thread->sched_next;
+        }
+        else
+        {
+            head = thread->sched_next;
+        }
+
+        if (thread->sched_next != nullptr)
+        {
+            thread->sched_next->sched_prev = thread->sched_prev;
+        }
+        else
+        {
+            tail = thread->sched_prev;
+        }
+
+        thread->sched_prev = thread->sched_next = nullptr;
+    }
+
+    void scheduler::enqueue(proc::thread* thread, bool front)
+    {
+        if (thread->sched_queued)
+        {
+            return;
+        }
+
+        auto& level = levels[thread->priority];
+        if (front)
+        {
+            level.push_front(thread);
+        }
+        else
+        {
+            level.push_back(thread);
+        }
+
+        thread->sched_queued = true;
+        thread->sched_core = owner;
+        ready_levels |= 1U << thread->priority;
+        std::direct_atomic_store_n(&ready_count, ready_count + 1, std::memory_order_relaxed);
+    }
+
+    void scheduler::dequeue(proc::thread* thread)
+    {
+        if (!thread->sched_queued)
+        {
+            return;
+        }
+
+        auto& level = levels[thread->priority];
+        level.remove(thread);
+        thread->sched_queued = false;
+        std::direct_atomic_store_n(&ready_count, ready_count - 1, std::memory_order_relaxed);
+        if (level.empty())
+        {
+            ready_levels &= ~(1U << thread->priority);
         }
-        else if (priority < old_priority)
+    }
+
+    auto scheduler::pop_highest() -> proc::thread*
+    {
+        if (ready_levels == 0)
+        {
+            return nullptr;
+        }
+
+        proc::thread* thread = levels[__builtin_ctz(ready_levels)].front();
+        dequeue(thread);
+        return thread;
+    }
+
+    auto scheduler::steal_for(std::size_t core) -> proc::thread*
+    {
+        lock::spinlock_guard guard(lock);
+        for (std::uint32_t pending = ready_levels; pending != 0; pending &= pending - 1)
         {
-            std::size_t index = target_index;
-            while (!is_lowest(index))
+            // the back of a level has waited the shortest, so it loses the least by moving
+            for (auto* thread = levels[__builtin_ctz(pending)].back(); thread != nullptr; thread = thread->sched_prev)
             {
-                if (task_heap[childl(index)].task_priority <= priority && task_heap[childr(index)].task_priority <= priority)
-                    break;
-                std::size_t new_index = task_heap[childl(index)].task_priority > task_heap[childr(index)].task_priority
-                                            ? childl(index)
-                                            : childr(index);
-                heap_swap(index, new_index);
-                index = new_index;
+                if (thread->runs_on(core))
+                {
+                    dequeue(thread);
+                    return thread;
+                }
             }
         }
+
+        return nullptr;
     }
 
-    proc::thread* scheduler::heap_pop()
+    void scheduler::kick()
     {
-        heap_swap(0, task_heap.size() - 1);
-        proc::thread* ret = task_heap.end()->th;
-        task_heap.size();
-
-        std::size_t index = 0;
-        std::int64_t priority = task_heap[0].task_priority;
-        while (!is_lowest(index))
+        auto& target = smp::core_local::get(owner);
+        std::uint8_t vector = target.apic.get_timer_vector();
+        // until its timer is set up the core is not scheduling yet, and its first tick will pick the work up anyway
+        if (vector == 0)
         {
-            if (task_heap[childl(index)].task_priority <= priority && task_heap[childr(index)].task_priority <= priority)
-                break;
-            std::size_t new_index = task_heap[childl(index)].task_priority > task_heap[childr(index)].task_priority
-                                        ? childl(index)
-                                        : childr(index);
-            heap_swap(index, new_index);
-            index = new_index;
+            return;
         }
 
-        return ret;
+        smp::core_local::get().apic.send_ipi(target.apic_id, vector);
     }
 
-    void scheduler::heap_push(proc::thread* th)
+    void scheduler::notify(std::uint8_t priority)
     {
-        task_heap.resize(task_heap.size() + 1);
+        // the exchange orders against the enqueue before it, a core going to sleep either sees the thread or gets kicked
+        bool sleeping = std::direct_atomic_exchange_n(&tick_stopped, false, std::memory_order_seq_cst);
+        if (sleeping || priority < std::direct_atomic_load_n(&running_priority, std::memory_order_relaxed))
+        {
+            kick();
+        }
     }
 
-    void scheduler::load_sched_task_ctx()
+    void scheduler::balance(std::size_t core, bool starving)
     {
-        if (task_heap.size() == 0)
-            klog::panic("idle() task not found!");
+        scheduler* busiest = nullptr;
+        scheduler* sleeping = nullptr;
+        std::size_t busiest_load = 0;
+        for (std::size_t i = 0; i < boot_resource::instance().core_count(); i++)
+        {
+            auto& other = smp::core_local::get(i).scheduler;
+            if (&other == this)
+            {
+                continue;
+            }
 
-        auto& local = smp::core_local::get();
-        proc::thread* next_thread = task_heap[0].th;
-        proc::thread* current_thread = local.current_thread;
-        if (current_thread)
-            heap_update(current_thread->sched_index, compute_priority(*current_thread));
+            if (other.load() > busiest_load)
+            {
+                busiest = &other;
+                busiest_load = other.load();
+            }
+            else if (sleeping == nullptr && std::direct_atomic_load_n(&other.tick_stopped, std::memory_order_relaxed))
+            {
+                sleeping = &other;
+            }
+        }
 
-        next_thread->latest_scheduled_tick = sched_ticks++;
-        local.current_thread = next_thread;
-        local.ctxbuffer = &next_thread->ctx;
-    }*/
+        // a sleeping core has no tick to look for work on its own, so it has to be woken to steal what we cannot run
+        // clearing the flag first makes sure only one core wakes it
+        if (!starving && sleeping != nullptr && load() != 0)
+        {
+            if (std::direct_atomic_exchange_n(&sleeping->tick_stopped, false, std::memory_order_seq_cst))
+            {
+                sleeping->kick();
+            }
+        }
+
+        // moving a thread back and forth between two cores that are one apart gains nothing
+        if (busiest == nullptr || (!starving && busiest_load <= load() + 1))
+        {
+            return;
+        }
+
+        // the victim's lock is dropped before ours is taken, so two cores stealing from each other cannot deadlock
+        proc::thread* thread = busiest->steal_for(core);
+        if (thread != nullptr)
+        {
+            lock::spinlock_guard guard(lock);
+            enqueue(thread, false);
+        }
+    }
 
     void scheduler::add_task(proc::thread* thread)
     {
-        if (thread->state == proc::thread_state::WAITING)
+        if (thread->state != proc::thread_state::RUNNING)
         {
             return; // no-op
         }
-        tasks.push(thread);
+
+        expect(thread->priority < proc::PRIORITY_LEVELS, "thread priority out of range");
+
+        lock::interrupt_save_guard irq;
+        {
+            lock::spinlock_guard guard(lock);
+            thread->timeslice = timeslice_of(thread->priority);
+            enqueue(thread, false);
+        }
+
+        notify(thread->priority);
     }
 
     void scheduler::set_state(proc::task_id tid, proc::thread_state state)
     {
-        SPINLOCK_SYNC_BLOCK;
         auto* thread = &proc::get_thread(tid);
-        if (thread->state == state)
+        if (state == proc::thread_state::RUNNING)
         {
+            wake(thread);
             return;
         }
 
-        if (state == proc::thread_state::RUNNING)
+        // the thread is queued on the core that last took it, and another core may steal it until that core's lock is held
+        lock::interrupt_save_guard irq;
+        while (true)
         {
-            tasks.push(thread);
+            auto core = std::direct_atomic_load_n(&thread->sched_core, std::memory_order_relaxed);
+            auto& owner = smp::core_local::get(core).scheduler;
+            lock::spinlock_guard guard(owner.lock);
+            if (thread->sched_core == core)
+            {
+                thread->state = state;
+                owner.dequeue(thread);
+                return;
+            }
         }
+    }
 
-        thread->state = state;
+    void scheduler::prepare_wait()
+    {
+        expect((read_rflags() & cpuflags::IF) == 0, "interrupts must be off until the thread is ready to be woken");
+        lock::spinlock_guard guard(lock);
+        smp::core_local::get().current_thread->state = proc::thread_state::WAITING;
     }
 
-    void scheduler::load_sched_task_ctx()
+    void scheduler::wait()
     {
-        auto& local = smp::core_local::get();
-        if ((local.current_thread != nullptr) && local.current_thread->state == proc::thread_state::RUNNING)
+        expect((read_rflags() & cpuflags::IF) != 0, "cannot block with interrupts off");
+
+        lock::interrupt_save_guard irq;
+        auto* self = smp::core_local::get().current_thread;
+
+        // the handler switches away from a waiting thread and this resumes once it was woken, or returns right away if that
+        // already happened
+        while (std::direct_atomic_load_n(&self->state, std::memory_order_acquire) != proc::thread_state::RUNNING)
         {
-            tasks.push(local.current_thread);
+            asm volatile("int %0" : : "i"(YIELD_VECTOR) : "memory");
         }
+    }
 
-        proc::thread* next_thread = idle;
-        while (tasks.pop(next_thread))
+    void scheduler::wake(proc::thread* thread)
+    {
+        lock::interrupt_save_guard irq;
+
+        // a waiting thread is on no runqueue, so nothing can move it to another core until it is woken
+        auto& target = smp::core_local::get(thread->sched_core).scheduler;
         {
-            if (next_thread->state == proc::thread_state::RUNNING)
+            lock::spinlock_guard guard(target.lock);
+            if (thread->state != proc::thread_state::WAITING)
+            {
+                return;
+            }
+
+            std::direct_atomic_store_n(&thread->state, proc::thread_state::RUNNING, std::memory_order_release);
+            // a thread that has not been switched away from yet simply keeps running
+            if (thread->on_cpu)
             {
-                break;
+                return;
             }
+
+            thread->timeslice = timeslice_of(thread->priority);
+            target.enqueue(thread, false);
         }
 
+        target.notify(thread->priority);
+    }
+
+    auto scheduler::switch_thread(proc::thread*& current, bool tick) -> bool
+    {
+        lock::spinlock_guard guard(lock);
+
+        if (current != nullptr && current->state == proc::thread_state::RUNNING)
+        {
+            if (tick && current->timeslice > 0)
+            {
+                current->timeslice--;
+            }
+
+            bool expired = current->timeslice == 0;
+            if (!expired && !has_above(current->priority))
+            {
+                return true;
+            }
+
+            // a thread that was preempted has not had its turn yet, so it keeps its place and the rest of its slice
+            if (expired)
+            {
+                current->timeslice = timeslice_of(current->priority);
+            }
+
+            enqueue(current, !expired);
+        }
+
+        proc::thread* next_thread = pop_highest();
+        if (current != nullptr)
+        {
+            current->on_cpu = false;
+        }
+
+        current = next_thread != nullptr ? next_thread : idle;
+        current->on_cpu = true;
+        current->sched_core = owner;
+        std::direct_atomic_store_n(&running_priority, next_thread != nullptr ? next_thread->priority : std::uint8_t(proc::PRIORITY_LEVELS),
+                                   std::memory_order_relaxed);
+        return next_thread != nullptr;
+    }
+
+    void scheduler::load_sched_task_ctx()
+    {
+        auto& local = smp::core_local::get();
+
+        // a core with nothing to do looks for work whenever it wakes up, a busy one only every so often
+        bool starving = load() == 0 && (local.current_thread == nullptr || local.current_thread == idle);
+        if (starving || ++balance_ticks >= config::get_val<"sched.balance-interval">)
+        {
+            balance_ticks = 0;
+            balance(local.core_id, starving);
+        }
+
+        std::uint64_t now = timer::now_ns();
+        bool tick = now >= next_tick;
+
+        proc::thread* next_thread = local.current_thread;
+        bool busy = switch_thread(next_thread, tick);
         local.current_thread = next_thread;
         local.ctxbuffer = &next_thread->ctx;
         // klog::log("sched task %d:%d\n", next_thread->id.proc, next_thread->id.thread);
         // debug::log_register(&next_thread->ctx);
+
+        if (!busy)
+        {
+            // the exchange orders against reading the load, a thread queued concurrently is either seen here or its sender
+            // sees the flag and kicks us
+            std::direct_atomic_exchange_n(&tick_stopped, true, std::memory_order_seq_cst);
+            if (load() == 0)
+            {
+                next_tick = timer::NEVER;
+                timer::reprogram(timer::NEVER);
+                return;
+            }
+        }
+
+        std::direct_atomic_store_n(&tick_stopped, false, std::memory_order_relaxed);
+        if (tick || next_tick == timer::NEVER)
+        {
+            next_tick = now + TICK_NS;
+        }
+        timer::reprogram(next_tick);
     }
 
     void scheduler::set_idle(proc::thread* thread)
@@ -135,6 +387,12 @@ namespace scheduler
         {
             klog::panic("cannot set non-idle task as idle");
         }
+
+        lock::interrupt_save_guard irq;
+        lock::spinlock_guard guard(lock);
+        // it was made like any other kernel thread, but only ever runs when nothing else is ready
+        dequeue(thread);
         idle = thread;
+        owner = smp::core_local::get().core_id;
     }
 } // namespace scheduler
@@ -15,12 +15,14 @@
 #include <misc/kassert.h>
 #include <misc/pointer.h>
 #include <mm/mm.h>
+#include <mm/numa.h>
 #include <mm/paging/paging.h>
 #include <mm/paging/paging_entries.h>
 #include <process/context.h>
 #include <smp/smp.h>
 #include <sync/spinlock.h>
 #include <sync_wrappers.h>
+#include <timer/timer.h>
 #include <user/elf_load.h>
 #include <user/syscall/sys_io.h>
 #include <utility>
@@ -58,7 +60,10 @@ namespace smp
             paging::map_hhdm_page(paging::page_type::SMALL, base);
             local.apic.enable();
             klog::log("APIC: ticks per ms: %lu", local.apic.calibrate());
-            local.apic.set_tick(idt::register_idt(idt::idt_builder(handlers::handle_timer).ist(1)), 20);
+            timer::init();
+            local.apic.init_timer(idt::register_idt(idt::idt_builder(handlers::handle_timer).ist(1)));
+            // the first tick starts scheduling, after that the scheduler rearms the timer only while there is work
+            local.apic.arm_timer(scheduler::TICK_NS);
         }
 
         [[noreturn]] void idle(std::uint64_t /*unused*/ = 0)
@@ -76,9 +81,12 @@ namespace smp
 
             auto init_pid = proc::make_process();
             klog::log("init process pid: %u", init_pid);
-            auto init_tid = proc::get_process(init_pid).make_thread({}, 0);
+            // other cores may steal the thread as soon as it is queued, so it waits until it has something to run
+            auto init_tid = proc::get_process(init_pid).make_thread({}, 0, proc::PRIORITY_NORMAL, proc::AFFINITY_ANY, proc::thread_state::WAITING);
             klog::log("init process tid: %u", init_pid);
-            user::load_elf(a_out, *proc::get_process(init_pid).get_thread(init_tid));
+            auto* init_thread = proc::get_process(init_pid).get_thread(init_tid);
+            expect(user::load_elf(a_out, *init_thread), "failed to load the init process");
+            scheduler::scheduler::wake(init_thread);
         }
 
         void make_idle()
@@ -110,6 +118,9 @@ namespace smp
             smp::core_local& local = smp::core_local::get();
 
             local.core_id = core_id;
+            local.apic_id = info->lapic_id;
+            local.numa_node = mm::numa_node_of_apic(info->lapic_id);
+            paging::init_pcid();
             local.current_thread = nullptr;
             local.ctxbuffer = new proc::context;
             local.idt_handler_entries = new std::uintptr_t[256];
@@ -122,6 +133,7 @@ namespace smp
             local.ist.ist5 = as_uptr(mm::allocate_stack());
             local.ist.ist6 = as_uptr(mm::allocate_stack());
             local.ist.ist7 = as_uptr(mm::allocate_stack());
+            mm::refill_fault_reserve();
 
             local.gdt.set_ist(&local.ist);
             gdt::install_gdt();
@@ -144,29 +156,43 @@ namespace smp
                                   .ist(1),
                               0x80);
 
+            expect(idt::register_idt(idt::idt_builder(handlers::handle_yield).ist(1), scheduler::YIELD_VECTOR),
+                   "failed to allocate irq for yielding");
+
             wait_sync_action([]() { expect(proc::make_process() == 0, "kernel proc should be pid=0"); });
 
             make_idle();
 
             proc::make_kthread_args(
                 +[](std::uint64_t arg) {
-                    thread_local std::size_t last_interrupt_count = 0;
                     klog::log("debugging task value: %lu", arg);
                     while (true)
                     {
-                        auto& local = smp::core_local::get();
-                        if (last_interrupt_count + 50 < local.timer_tick_count)
-                        {
-                            last_interrupt_count = local.timer_tick_count;
-                            klog::log("ping");
-                        }
+                        timer::sleep_for(timer::NS_PER_SEC);
+                        klog::log("ping");
                     }
                 },
                 core_id);
 
+            timer::sync_clock();
             initialize_apic(smp::core_local::get());
+            paging::init_tlb_shootdown();
 
             run_init();
+            // the rest of physical memory is set up by all cores together, in the background so that it neither holds up
+            // the init process nor keeps interrupts off for long
+            proc::make_kthread_args(
+                +[](std::uint64_t /*unused*/) {
+                    mm::pmm_init_deferred();
+
+                    // there is no way for a thread to exit yet, so it parks itself for good
+                    {
+                        lock::interrupt_save_guard irq;
+                        smp::core_local::get().scheduler.prepare_wait();
+                    }
+                    scheduler::scheduler::wait();
+                },
+                0, core_id, proc::PRIORITY_BATCH, core_id < 64 ? 1UL << core_id : proc::AFFINITY_ANY);
             idle();
         }
 
@@ -182,7 +208,7 @@ namespace smp
 
         for (std::size_t i = 0; i < 256; i++)
         {
-            auto& entry = smp::core_local::get().pagemap[256 + i];
+            auto& entry = paging::kernel_table()[256 + i];
 
             if (!entry)
             {
@@ -201,7 +227,7 @@ namespace smp
             if (smp->bsp_lapic_id == smp->cpus[i]->lapic_id)
             {
                 bsp_index = i;
-                smp->cpus[i]->extra_argument = as_uptr(smp::core_local::get(0).pagemap);
+                smp->cpus[i]->extra_argument = as_uptr(paging::kernel_table());
                 continue;
             }
 
@@ -210,10 +236,7 @@ namespace smp
 
             // remember that stack grows down
 
-            smp->cpus[i]->extra_argument =
-                as_uptr(smp::core_local::get(core_id).pagemap = as_ptr<paging::page_table_entry>(mm::pmm_allocate_clean())) | core_id;
-
-            paging::sync_page_tables(core_id, 0);
+            smp->cpus[i]->extra_argument = as_uptr(paging::kernel_table()) | core_id;
             std::direct_atomic_store_n(as_ptr<std::uint64_t>(&smp->cpus[i]->goto_address), as_uptr(smp::main_wrapper), std::memory_order_seq_cst);
         }
 
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cstring>
 #include <klog/klog.h>
+#include <misc/cast.h>
 #include <new>
 #include <smp/smp.h>
 #include <sync/spinlock.h>
@@ -72,28 +73,17 @@ namespace
     auto emutls_get_address_array(std::uintptr_t index) -> void**
     {
         auto& local = smp::core_local::get();
-        auto* array = local.emutls_data;
-        if (array == nullptr)
+        if (index >= local.emutls_size)
         {
+            std::size_t old_size = local.emutls_size;
             local.emutls_size = emutls_new_data_array_size(index);
-            array = local.emutls_data = new void*[local.emutls_size];
-        }
-        else if (index >= local.emutls_size)
-        {
-            local.emutls_size = emutls_new_data_array_size(index);
-            local.emutls_data = new void*[local.emutls_size];
+            local.emutls_data = as_ptr<void*>(std::detail::realloc(local.emutls_data, local.emutls_size * sizeof(void*)));
 
-            // copy over the old entries
-            for (std::size_t i = 0; i < local.emutls_size; i++)
-            {
-                local.emutls_data[i] = array[i];
-            }
-
-            // free the new ones
-            delete array;
+            // the new slots haven't had their objects allocated yet
+            std::memset(local.emutls_data + old_size, 0, (local.emutls_size - old_size) * sizeof(void*));
         }
-    
-        return array;
+
+        return local.emutls_data;
     }
 } // namespace
 
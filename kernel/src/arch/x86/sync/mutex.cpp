@@ -0,0 +1,162 @@
+#include <asm/asm_cpp.h>
+#include <misc/cast.h>
+#include <process/scheduler/scheduler.h>
+#include <smp/smp.h>
+#include <sync/mutex.h>
+#include <timer/timer.h>
+
+namespace lock
+{
+    void semaphore_base::push(waiter& w)
+    {
+        w.prev = tail;
+        w.next = nullptr;
+        if (tail != nullptr)
+        {
+            tail->next = &w;
+        }
+        else
+        {
+            head = &w;
+        }
+        tail = &w;
+    }
+
+    void semaphore_base::remove(waiter& w)
+    {
+        if (w.prev != nullptr)
+        {
+            w.prev->next = w.next;
+        }
+        else
+        {
+            head = w.next;
+        }
+
+        if (w.next != nullptr)
+        {
+            w.next->prev = w.prev;
+        }
+        else
+        {
+            tail = w.prev;
+        }
+    }
+
+    auto semaphore_base::acquire(std::uint64_t deadline) -> bool
+    {
+        proc::thread* self = smp::core_local::exists() ? smp::core_local::get().current_thread : nullptr;
+        bool blocking = self != nullptr && self->state == proc::thread_state::RUNNING && (read_rflags() & cpuflags::IF) != 0;
+
+        waiter w{.owner = this, .thread = blocking ? self : nullptr};
+        timer::event timeout{
+            // whoever takes the waiter off the list wakes it, so it is only ever woken once
+            .callback =
+                [](timer::event& ev) {
+                    auto& w = *as_ptr<waiter>(ev.data);
+                    proc::thread* thread = w.thread;
+                    {
+                        spinlock_guard guard(w.owner->internal_spinlock);
+                        if (w.granted)
+                        {
+                            return;
+                        }
+                        w.owner->remove(w);
+                    }
+                    scheduler::scheduler::wake(thread);
+                },
+            .data = &w,
+        };
+
+        {
+            interrupt_save_guard irq;
+            {
+                spinlock_guard guard(internal_spinlock);
+                if (count != 0)
+                {
+                    count--;
+                    return true;
+                }
+
+                if (deadline != timer::NEVER && timer::now_ns() >= deadline)
+                {
+                    return false;
+                }
+
+                push(w);
+                if (blocking)
+                {
+                    smp::core_local::get().scheduler.prepare_wait();
+                }
+            }
+
+            if (blocking && deadline != timer::NEVER)
+            {
+                timer::arm(timeout, deadline);
+            }
+        }
+
+        if (!blocking)
+        {
+            while (true)
+            {
+                pause();
+                interrupt_save_guard irq;
+                spinlock_guard guard(internal_spinlock);
+                if (w.granted)
+                {
+                    return true;
+                }
+
+                if (deadline != timer::NEVER && timer::now_ns() >= deadline)
+                {
+                    remove(w);
+                    return false;
+                }
+            }
+        }
+
+        scheduler::scheduler::wait();
+        if (deadline != timer::NEVER)
+        {
+            timer::cancel(timeout);
+        }
+
+        // the timeout only takes the waiter off the list if release() has not granted it a token yet
+        interrupt_save_guard irq;
+        spinlock_guard guard(internal_spinlock);
+        return w.granted;
+    }
+
+    void semaphore_base::lock() { acquire(timer::NEVER); }
+
+    auto semaphore_base::try_lock() -> bool { return acquire(0); }
+
+    auto semaphore_base::try_lock_for(std::uint64_t ns) -> bool { return acquire(timer::now_ns() + ns); }
+
+    void semaphore_base::release()
+    {
+        proc::thread* thread = nullptr;
+
+        {
+            interrupt_save_guard irq;
+            spinlock_guard guard(internal_spinlock);
+            if (head == nullptr)
+            {
+                count++;
+                return;
+            }
+
+            // the token goes straight to the first waiter, after this it may return and take its waiter off the stack
+            waiter& w = *head;
+            remove(w);
+            w.granted = true;
+            thread = w.thread;
+        }
+
+        if (thread != nullptr)
+        {
+            scheduler::scheduler::wake(thread);
+        }
+    }
+} // namespace lock
@@ -0,0 +1,226 @@
+#include <acpi/acpi.h>
+#include <asm/asm_cpp.h>
+#include <atomic>
+#include <cpuid/cpuid.h>
+#include <kinit/boot_resource.h>
+#include <klog/klog.h>
+#include <misc/cast.h>
+#include <mm/mm.h>
+#include <mm/paging/paging.h>
+#include <smp/smp.h>
+#include <sync/spinlock.h>
+#include <timer/clock.h>
+#include <timer/timer.h>
+
+namespace timer
+{
+    namespace
+    {
+        // long enough that the reference's resolution and the cost of reading it do not matter
+        inline constexpr std::uint64_t CALIBRATION_NS = 10 * NS_PER_MS;
+
+        inline constexpr std::uint64_t PIT_HZ = 1193182;
+        inline constexpr std::uint16_t PIT_INIT_VALUE = 0xffff;
+
+        inline constexpr std::size_t HPET_CAPABILITIES = 0x0;
+        inline constexpr std::size_t HPET_CONFIG = 0x10;
+        inline constexpr std::size_t HPET_MAIN_COUNTER = 0xf0;
+        inline constexpr std::uint64_t HPET_CONFIG_ENABLE = 1;
+        inline constexpr std::uint64_t FS_PER_NS = 1000000;
+
+        // each probe is a round trip to the bootstrap core, the fastest one bounds the error best
+        inline constexpr std::size_t SYNC_ROUNDS = 16;
+
+        // now_ns() is ((tsc - tsc_base) * tsc_mult) >> 32, with both fixed before the other cores start
+        std::uint64_t tsc_base = 0;
+        std::uint64_t tsc_mult = 0;
+        std::uint64_t tsc_rate = 0;
+        bool invariant = false;
+
+        // the probes other cores send the bootstrap core while they sync, one core at a time
+        struct
+        {
+            lock::spinlock lock;
+            std::uint64_t request;
+            std::uint64_t answer;
+            std::uint64_t reference;
+            std::size_t synced;
+        } sync;
+
+        struct calibration
+        {
+            std::uint64_t tsc;
+            std::uint64_t ns;
+        };
+
+        void write_pit_timer(std::uint16_t ticks)
+        {
+            outb(ioports::PIT_MODE_COMMAND, 0b00110000);
+            outb(ioports::PIT_DATA_CHAN_0, ticks);
+            outb(ioports::PIT_DATA_CHAN_0, ticks >> 8);
+        }
+
+        auto read_pit_timer() -> std::uint16_t
+        {
+            outb(ioports::PIT_MODE_COMMAND, 0);
+            unsigned count = inb(ioports::PIT_DATA_CHAN_0);
+            count |= inb(ioports::PIT_DATA_CHAN_0) << 8;
+            return count;
+        }
+
+        auto calibrate_pit() -> calibration
+        {
+            std::uint64_t target = CALIBRATION_NS * PIT_HZ / NS_PER_SEC;
+
+            write_pit_timer(PIT_INIT_VALUE);
+            std::uint64_t tsc_start = rdtsc_ordered();
+            std::uint64_t elapsed = 0;
+            while (elapsed < target)
+            {
+                elapsed = PIT_INIT_VALUE - read_pit_timer();
+            }
+
+            return {rdtsc_ordered() - tsc_start, elapsed * NS_PER_SEC / PIT_HZ};
+        }
+
+        auto find_hpet() -> const acpi::hpet*
+        {
+            const acpi::hpet* table = nullptr;
+            boot_resource::instance().iterate_xsdt([&](const acpi::acpi_sdt_header* entry) {
+                auto* header = mm::make_virtual<const acpi::acpi_sdt_header>(as_uptr(entry));
+                if (header->signature == acpi::hpet::SIGNATURE)
+                {
+                    table = cast_ptr<const acpi::hpet>(header);
+                }
+            });
+
+            return table;
+        }
+
+        auto calibrate_hpet(const acpi::hpet& table) -> calibration
+        {
+            paging::map_hhdm_page(paging::page_type::SMALL, table.address);
+            auto* regs = mm::make_virtual<volatile std::uint64_t>(table.address);
+            auto reg = [&](std::size_t offset) -> volatile std::uint64_t& { return regs[offset / sizeof(std::uint64_t)]; };
+
+            std::uint64_t period_fs = reg(HPET_CAPABILITIES) >> 32;
+            reg(HPET_CONFIG) = reg(HPET_CONFIG) | HPET_CONFIG_ENABLE;
+
+            std::uint64_t target = CALIBRATION_NS * FS_PER_NS / period_fs;
+            std::uint64_t start = reg(HPET_MAIN_COUNTER);
+            std::uint64_t tsc_start = rdtsc_ordered();
+            std::uint64_t elapsed = 0;
+            while (elapsed < target)
+            {
+                elapsed = reg(HPET_MAIN_COUNTER) - start;
+            }
+
+            return {rdtsc_ordered() - tsc_start, elapsed * period_fs / FS_PER_NS};
+        }
+    } // namespace
+
+    void init_clock()
+    {
+        invariant = cpuid_info::test_feature(cpuid_info::FEATURE_INVARIANT_TSC);
+        if (!invariant)
+        {
+            klog::log("clock: the TSC is not invariant, time will drift with the cpu frequency");
+        }
+
+        // a 32 bit HPET wraps after a few minutes at most, far more than the calibration takes
+        const auto* hpet = find_hpet();
+        bool use_hpet = hpet != nullptr && hpet->address_space_id == 0;
+        calibration result = use_hpet ? calibrate_hpet(*hpet) : calibrate_pit();
+
+        tsc_rate = result.tsc * NS_PER_MS / result.ns;
+        tsc_mult = (result.ns << 32) / result.tsc;
+        tsc_base = rdtsc_ordered();
+        klog::log("clock: %lu TSC ticks per ms, calibrated against the %s", tsc_rate, use_hpet ? "HPET" : "PIT");
+    }
+
+    void sync_clock()
+    {
+        auto& local = smp::core_local::get();
+        std::size_t others = boot_resource::instance().core_count() - 1;
+
+        if (local.core_id == 0)
+        {
+            std::uint64_t answered = 0;
+            while (std::direct_atomic_load_n(&sync.synced, std::memory_order_acquire) < others)
+            {
+                std::uint64_t request = std::direct_atomic_load_n(&sync.request, std::memory_order_acquire);
+                if (request != answered)
+                {
+                    std::direct_atomic_store_n(&sync.reference, rdtsc_ordered(), std::memory_order_relaxed);
+                    std::direct_atomic_store_n(&sync.answer, request, std::memory_order_release);
+                    answered = request;
+                }
+                pause();
+            }
+            return;
+        }
+
+        lock::spinlock_guard guard(sync.lock);
+        std::uint64_t best_rtt = ~0UL;
+        std::int64_t best_offset = 0;
+        for (std::size_t i = 0; i < SYNC_ROUNDS; i++)
+        {
+            std::uint64_t request = sync.request + 1;
+            std::uint64_t start = rdtsc_ordered();
+            std::direct_atomic_store_n(&sync.request, request, std::memory_order_release);
+            while (std::direct_atomic_load_n(&sync.answer, std::memory_order_acquire) != request)
+            {
+                pause();
+            }
+            std::uint64_t end = rdtsc_ordered();
+
+            // the reference was taken somewhere within the round trip, the middle is the best guess
+            std::uint64_t rtt = end - start;
+            if (rtt < best_rtt)
+            {
+                best_rtt = rtt;
+                best_offset = std::int64_t(std::direct_atomic_load_n(&sync.reference, std::memory_order_relaxed) - (start + rtt / 2));
+            }
+        }
+
+        // an offset within the measurement error is more likely noise than skew, correcting for it would only add some
+        if (std::uint64_t(best_offset < 0 ? -best_offset : best_offset) <= best_rtt / 2)
+        {
+            best_offset = 0;
+        }
+
+        local.tsc_offset = best_offset;
+        if (best_offset != 0)
+        {
+            klog::log("clock: TSC is %ld ticks off from the bootstrap core", -best_offset);
+        }
+
+        std::direct_atomic_fetch_add(&sync.synced, std::size_t{1}, std::memory_order_release);
+    }
+
+    auto now_ns() -> std::uint64_t
+    {
+        std::uint64_t tsc = 0;
+        if (smp::core_local::exists())
+        {
+            // a thread that moved to another core in between would pair one core's TSC with the other's offset
+            smp::core_local* local = nullptr;
+            do
+            {
+                local = smp::core_local::get_pointer();
+                tsc = rdtsc() + local->tsc_offset;
+            } while (local != smp::core_local::get_pointer());
+        }
+        else
+        {
+            tsc = rdtsc();
+        }
+
+        // cores whose TSC is a bit behind could read a moment before the base right after boot
+        return tsc > tsc_base ? (static_cast<unsigned __int128>(tsc - tsc_base) * tsc_mult) >> 32 : 0;
+    }
+
+    auto tsc_per_ms() -> std::uint64_t { return tsc_rate; }
+
+    auto clock_invariant() -> bool { return invariant; }
+} // namespace timer
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <apic/apic.h>
+#include <asm/asm_cpp.h>
+#include <atomic>
+#include <misc/cast.h>
+#include <process/process.h>
+#include <process/scheduler/scheduler.h>
+#include <smp/smp.h>
+#include <timer/timer.h>
+#include <utility>
+
+namespace timer
+{
+    namespace
+    {
+        // timers fire on the first tick at or after their deadline, never before it
+        INLINE auto tick_of(std::uint64_t ns) -> std::uint64_t { return (ns >> TICK_SHIFT) + ((ns & ((1UL << TICK_SHIFT) - 1)) != 0); }
+        INLINE auto ns_of(std::uint64_t tick) -> std::uint64_t { return tick == NEVER ? NEVER : tick << TICK_SHIFT; }
+
+        INLINE auto level_shift(std::size_t level) -> std::size_t { return level * SLOT_SHIFT; }
+
+        // the first offset in [1, SLOTS] past start whose bit is set in occupied, or 0 if there is none
+        INLINE auto next_occupied(std::uint64_t occupied, std::size_t start) -> std::size_t
+        {
+            if (occupied == 0)
+            {
+                return 0;
+            }
+
+            std::size_t from = (start + 1) % SLOTS;
+            std::uint64_t rotated = (occupied >> from) | (from != 0 ? occupied << (SLOTS - from) : 0);
+            return __builtin_ctzl(rotated) + 1;
+        }
+
+        void push(event*& list, event& ev)
+        {
+            ev.prev = nullptr;
+            ev.next = list;
+            if (list != nullptr)
+            {
+                list->prev = &ev;
+            }
+            list = &ev;
+        }
+
+        auto local_wheel() -> wheel& { return smp::core_local::get().timer_wheel; }
+    } // namespace
+
+    void wheel::insert(event& ev)
+    {
+        std::uint64_t target = std::max(tick_of(ev.deadline), current + 1);
+        std::uint64_t delta = target - current;
+
+        std::size_t level = 0;
+        while (level + 1 < LEVELS && delta >= (1UL << level_shift(level + 1)))
+        {
+            level++;
+        }
+
+        // past the top level's reach the event waits in its furthest slot, and is placed again once the wheel gets there
+        if (delta >= (1UL << level_shift(LEVELS)))
+        {
+            target = current + (1UL << level_shift(LEVELS)) - 1;
+        }
+
+        std::size_t slot = (target >> level_shift(level)) % SLOTS;
+        ev.slot = level * SLOTS + slot;
+        push(slots[ev.slot], ev);
+        occupied[level] |= 1UL << slot;
+    }
+
+    void wheel::unlink(event& ev)
+    {
+        if (ev.prev != nullptr)
+        {
+            ev.prev->next = ev.next;
+        }
+        else
+        {
+            slots[ev.slot] = ev.next;
+        }
+
+        if (ev.next != nullptr)
+        {
+            ev.next->prev = ev.prev;
+        }
+
+        if (slots[ev.slot] == nullptr)
+        {
+            occupied[ev.slot / SLOTS] &= ~(1UL << (ev.slot % SLOTS));
+        }
+    }
+
+    auto wheel::next_tick() const -> std::uint64_t
+    {
+        std::uint64_t next = NEVER;
+        for (std::size_t level = 0; level < LEVELS; level++)
+        {
+            // a slot on level l needs processing at the start of the span it covers
+            std::uint64_t base = current >> level_shift(level);
+            if (std::size_t offset = next_occupied(occupied[level], base % SLOTS); offset != 0)
+            {
+                next = std::min(next, (base + offset) << level_shift(level));
+            }
+        }
+
+        return next;
+    }
+
+    void wheel::advance(std::uint64_t target, event*& due)
+    {
+        for (std::uint64_t next = next_tick(); next <= target; next = next_tick())
+        {
+            current = next;
+
+            // higher levels first, so that events moving down to level 0 are caught by this very tick
+            for (std::size_t level = LEVELS; level-- > 0;)
+            {
+                if ((current & ((1UL << level_shift(level)) - 1)) != 0)
+                {
+                    continue;
+                }
+
+                std::size_t index = level * SLOTS + (current >> level_shift(level)) % SLOTS;
+                event* list = std::exchange(slots[index], nullptr);
+                occupied[level] &= ~(1UL << (index % SLOTS));
+
+                while (list != nullptr)
+                {
+                    event& ev = *list;
+                    list = ev.next;
+
+                    if (tick_of(ev.deadline) <= current)
+                    {
+                        ev.pending = false;
+                        push(due, ev);
+                    }
+                    else
+                    {
+                        insert(ev);
+                    }
+                }
+            }
+        }
+
+        current = std::max(current, target);
+    }
+
+    void wheel::program()
+    {
+        std::uint64_t deadline = std::min(tick, ns_of(next_tick()));
+        armed = deadline;
+
+        auto& apic = smp::core_local::get().apic;
+        // threads can block and yield before the core's timer is set up, the first arm_timer() takes over from there
+        if (apic.get_timer_vector() == 0)
+        {
+            return;
+        }
+
+        if (deadline == NEVER)
+        {
+            apic.stop_timer();
+            return;
+        }
+
+        std::uint64_t now = now_ns();
+        apic.arm_timer(deadline > now ? deadline - now : 0);
+    }
+
+    void init() { local_wheel().current = now_ns() >> TICK_SHIFT; }
+
+    void arm(event& ev, std::uint64_t deadline)
+    {
+        lock::interrupt_save_guard irq;
+        auto& local = local_wheel();
+        lock::spinlock_guard guard(local.lock);
+
+        ev.deadline = deadline;
+        ev.core = smp::core_local::get().core_id;
+        ev.pending = true;
+        local.insert(ev);
+
+        if (ns_of(tick_of(deadline)) < local.armed)
+        {
+            local.program();
+        }
+    }
+
+    auto cancel(event& ev) -> bool
+    {
+        lock::interrupt_save_guard irq;
+        auto& owner = smp::core_local::get(ev.core).timer_wheel;
+
+        {
+            lock::spinlock_guard guard(owner.lock);
+            if (ev.pending)
+            {
+                // an earlier LAPIC deadline than needed only costs a spurious interrupt, so it is left alone
+                owner.unlink(ev);
+                ev.pending = false;
+                return true;
+            }
+        }
+
+        // the callback may still be running on the wheel's core, and it may touch the event until it returns
+        while (std::direct_atomic_load_n(&owner.expiring, std::memory_order_acquire))
+        {
+            pause();
+        }
+        return false;
+    }
+
+    void run_expired()
+    {
+        auto& local = local_wheel();
+        event* due = nullptr;
+
+        {
+            lock::spinlock_guard guard(local.lock);
+            local.advance(now_ns() >> TICK_SHIFT, due);
+            // whoever sees an event not pending anymore has to see this as well, the callback may not have run yet
+            std::direct_atomic_store_n(&local.expiring, due != nullptr, std::memory_order_relaxed);
+        }
+
+        while (due != nullptr)
+        {
+            // the callback may end the event's lifetime, for instance by waking the thread whose stack it sits on
+            event& ev = *due;
+            due = ev.next;
+            ev.callback(ev);
+        }
+
+        std::direct_atomic_store_n(&local.expiring, false, std::memory_order_release);
+    }
+
+    void reprogram(std::uint64_t tick_deadline)
+    {
+        auto& local = local_wheel();
+        lock::spinlock_guard guard(local.lock);
+        local.tick = tick_deadline;
+        local.program();
+    }
+
+    void sleep_until(std::uint64_t deadline)
+    {
+        proc::thread* self = smp::core_local::exists() ? smp::core_local::get().current_thread : nullptr;
+        if (self == nullptr || self->state != proc::thread_state::RUNNING || (read_rflags() & cpuflags::IF) == 0)
+        {
+            while (now_ns() < deadline)
+            {
+                pause();
+            }
+            return;
+        }
+
+        event ev{
+            .callback = [](event& ev) { scheduler::scheduler::wake(as_ptr<proc::thread>(ev.data)); },
+            .data = self,
+        };
+
+        {
+            lock::interrupt_save_guard irq;
+            smp::core_local::get().scheduler.prepare_wait();
+            arm(ev, deadline);
+        }
+
+        scheduler::scheduler::wait();
+    }
+} // namespace timer
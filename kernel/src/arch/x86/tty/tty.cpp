@@ -46,11 +46,9 @@ namespace tty
 
                 std::size_t pages = std::div_roundup(size, paging::PAGE_SMALL_SIZE);
 
-                for (std::size_t i = 0; i < pages; i++)
-                {
-                    auto* p = expect_nonnull(mm::pmm_allocate_clean());
-                    paging::request_page(paging::page_type::SMALL, SCROLLBACK_START + i * paging::PAGE_SMALL_SIZE, mm::make_physical(p));
-                }
+                paging::invalidate_local(paging::map_range(
+                    paging::kernel_table(), SCROLLBACK_START, [](std::size_t) { return mm::make_physical(expect_nonnull(mm::pmm_allocate_clean())); },
+                    pages, {}));
                 return as_vptr(SCROLLBACK_START);
             },
 
@@ -6,6 +6,7 @@
 #include <misc/cast.h>
 #include <misc/kassert.h>
 #include <misc/pointer.h>
+#include <mm/address_space.h>
 #include <mm/mm.h>
 #include <mm/paging/paging.h>
 #include <mm/paging/paging_entries.h>
@@ -114,8 +115,9 @@ namespace user
 
         // setup state
         auto builder = proc::context_builder(proc::context_builder::USER, header->entry);
-        paging::page_table_entry* table = as_ptr(expect_nonnull(mm::pmm_allocate_clean(), ":3"));
-        builder.set_cr3(as_uptr(table));
+        auto* space = new mm::address_space();
+        proc::get_process(thread.id.proc).set_address_space(space);
+        builder.set_cr3(as_uptr(space->get_table()));
 
         elf::elf64_program_header* segments = cast_ptr(ptr_off(header, header->ph_off));
 
@@ -130,24 +132,15 @@ namespace user
                     break;
                 }
 
-                // TODO: don't copy, just add the mapping!
-                // we have to map from div_rounddown(vaddr, page_size) to div_roundup(vaddr + memsz, page_size)
-
-                paging::page_prop prop{.rw = bool(segment.flags & 0x2), .us = true, .x = bool(segment.flags & 0x4)};
-
-                void* current_page = nullptr;
-
-                for (std::size_t addr = segment.vaddr, offset = segment.offset; addr < segment.vaddr + segment.memsz; addr++, offset++)
-                {
-                    if (addr % paging::PAGE_SMALL_SIZE == 0 || current_page == nullptr)
-                    {
-                        current_page = mm::pmm_allocate_clean();
-                        paging::map_page_for(table, paging::SMALL, addr, mm::make_physical(current_page), prop, true);
-                    }
-
-                    std::uint8_t current_byte = (offset > segment.offset + segment.filesz) ? 0 : *as_ptr<std::uint8_t>(ptr_off(elf_data, offset));
-                    *as_ptr<std::uint8_t>(ptr_off(current_page, addr % paging::PAGE_SMALL_SIZE)) = current_byte;
-                }
+                // nothing is copied here, the pages are filled from the image the first time they are touched
+                space->add_area({
+                    .start = segment.vaddr & ~(paging::PAGE_SMALL_SIZE - 1),
+                    .end = std::div_roundup(segment.vaddr + segment.memsz, paging::PAGE_SMALL_SIZE) * paging::PAGE_SMALL_SIZE,
+                    .prop = {.rw = bool(segment.flags & 0x2), .us = true, .x = bool(segment.flags & 0x1)},
+                    .data_start = segment.vaddr,
+                    .data = ptr_off(elf_data, segment.offset),
+                    .data_size = segment.filesz,
+                });
             }
                 // these aren't loaded sections, just ignore them
             case elf::PT_NULL:
@@ -162,8 +155,6 @@ namespace user
         // builder.set_stack(paging::PAGE_SMALL_SIZE);
 
         thread.ctx = builder.build();
-
-        paging::copy_kernel_page_tables(as_ptr(table), smp::core_local::get().pagemap);
         return true;
     }
 } // namespace user
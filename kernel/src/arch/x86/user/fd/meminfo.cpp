@@ -0,0 +1,21 @@
+#include <mm/stats.h>
+#include <user/fd/meminfo.h>
+
+namespace user::fd
+{
+    auto meminfo_fd::read(file_desc& /*unused*/, user_pointer<std::uint8_t> buffer, std::size_t count) const -> std::ssize_t
+    {
+        // TODO: copy to user space instead of writing through the pointer, once there is a way to check it
+        return static_cast<std::ssize_t>(mm::format_meminfo(reinterpret_cast<char*>(buffer.get()), count));
+    }
+
+    auto meminfo_fd::write(file_desc& /*unused*/, user_pointer<const std::uint8_t> /*unused*/, std::size_t /*unused*/) const -> std::ssize_t
+    {
+        return -1;
+    }
+
+    auto meminfo_fd::close(file_desc& /*unused*/) const -> std::ssize_t { return 0; }
+
+    // the contents are generated on every read, so there is nothing to seek in
+    auto meminfo_fd::seek(file_desc& /*unused*/, std::ssize_t /*unused*/, seek_type /*unused*/) const -> std::ssize_t { return -1; }
+} // namespace user::fd
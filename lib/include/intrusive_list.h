@@ -67,17 +67,19 @@ namespace std
 
             if (prev)
             {
-                prev->get_next(next);
+                prev->set_next(next);
             }
             else
             {
                 front = next;
             }
 
-            if (prev)
+            if (next)
             {
                 next->set_prev(prev);
             }
+
+            reset_node(node);
             return node;
         }
 
@@ -1,33 +1,92 @@
 #include <bits/user_implement.h>
 #include <config.h>
+#include <cstring>
 #include <debug/debug.h>
+#include <misc/cast.h>
 #include <mm/malloc.h>
+#include <mm/slab.h>
 #include <sync/spinlock.h>
 
 namespace std::detail
 {
     static lock::spinlock malloc_lock;
 
+    namespace
+    {
+        inline constexpr size_t SLAB_MAX_SIZE = 1UL << config::get_val<"slab.max_order">;
+
+        // anything that didn't come from the heap came from the slab allocator
+        INLINE auto is_heap_pointer(void* pointer) -> bool
+        {
+            return as_uptr(pointer) - config::get_val<"mmap.start.heap"> < config::get_val<"mmap.size.heap">;
+        }
+    } // namespace
+
     auto malloc(size_t size) -> void*
     {
+        if (size <= SLAB_MAX_SIZE)
+        {
+            return mm::slab_allocate(size);
+        }
+
         lock::spinlock_guard guard(malloc_lock);
         return ::alloc::malloc(size);
     }
 
     auto aligned_malloc(size_t size, size_t align) -> void*
     {
+        // slab objects are aligned to their size class
+        if (size <= SLAB_MAX_SIZE && align <= SLAB_MAX_SIZE && (align & (align - 1)) == 0)
+        {
+            return mm::slab_allocate(size > align ? size : align);
+        }
+
         lock::spinlock_guard guard(malloc_lock);
         return ::alloc::aligned_malloc(size, align);
     }
 
     auto realloc(void* pointer, size_t size) -> void*
     {
-        lock::spinlock_guard guard(malloc_lock);
-        return ::alloc::realloc(pointer, size);
+        if (pointer == nullptr)
+        {
+            return malloc(size);
+        }
+
+        if (is_heap_pointer(pointer))
+        {
+            lock::spinlock_guard guard(malloc_lock);
+            return ::alloc::realloc(pointer, size);
+        }
+
+        size_t old_size = mm::slab_size(pointer);
+        if (size <= old_size)
+        {
+            return pointer;
+        }
+
+        void* new_pointer = malloc(size);
+        if (new_pointer != nullptr)
+        {
+            std::memcpy(new_pointer, pointer, old_size);
+            mm::slab_free(pointer);
+        }
+
+        return new_pointer;
     }
 
     void free(void* pointer)
     {
+        if (pointer == nullptr)
+        {
+            return;
+        }
+
+        if (!is_heap_pointer(pointer))
+        {
+            mm::slab_free(pointer);
+            return;
+        }
+
         lock::spinlock_guard guard(malloc_lock);
         return ::alloc::free(pointer);
     }